@@ -0,0 +1,984 @@
+/*
+ * Copyright 2013, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of NUCI configuration server.
+ *
+ * NUCI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * NUCI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// For pipe2
+#define _GNU_SOURCE
+
+#include "commands.h"
+#include "logging.h"
+
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+extern char **environ;
+
+// Size of the buffer for the streamed output
+#define STREAM_BUFFER 4096
+// How long to wait after SIGTERM before SIGKILL, and after SIGKILL before giving up on the pipes
+#define KILL_GRACE 1000
+
+// Deadline (monotonic ms) of the current RPC for all the commands, 0 if none
+static uint64_t budget_deadline;
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void commands_set_budget(int seconds) {
+	budget_deadline = seconds > 0 ? now_ms() + (uint64_t) seconds * 1000 : 0;
+}
+
+// Check the result is not -1, cause abort and error message if it is
+static void check(int result, const char *operation) {
+	if (result == -1) {
+		die("Error during %s: %s", operation, strerror(errno));
+	}
+}
+
+// Like check, but for the functions returning the error number
+static void checke(int result, const char *operation) {
+	if (result != 0) {
+		die("Error during %s: %s", operation, strerror(result));
+	}
+}
+
+// Set fd nonblocking
+static void unblock(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	check(flags, "Getting fd flags");
+	check(fcntl(fd, F_SETFL, flags | O_NONBLOCK), "Setting fd non-blocking");
+}
+
+// Output of the command, growing as needed
+struct buffer {
+	char *data;
+	size_t allocated, len;
+};
+
+// One external command, possibly running
+struct child {
+	char **argv; // NULL-terminated, the first one is the command
+	pid_t pid;
+	// Our ends of the pipes, -1 when closed
+	int in_fd, out_fd, err_fd;
+	// Becomes readable when the child terminates. -1 if not available or already reaped.
+	int pid_fd;
+	bool reaped;
+	const char *input;
+	size_t input_len, input_pos;
+	struct buffer out, err;
+	int status;
+	struct timespec start;
+	uint64_t timeout; // In ms, 0 for none
+	uint64_t deadline; // When to take the next action against the child, 0 for never
+	int kill_stage; // How many times the deadline passed already
+	bool timed_out; // Killed because of the deadline
+	bool over_budget; // The deadline was the one of the RPC
+	/*
+	 * The stdout is consumed as it comes (see run_command_lines), so it
+	 * is read into fixed buffer and only when there's space in it.
+	 */
+	bool stream;
+};
+
+static void buffer_init(struct buffer *buffer, size_t size) {
+	*buffer = (struct buffer) {
+		.data = malloc(size),
+		.allocated = size
+	};
+}
+
+// Feed a bit of the input to the child. Close the pipe once everything is written.
+static void child_feed(struct child *child) {
+	if (child->input_pos == child->input_len) {
+		check(close(child->in_fd), "closing stdin");
+		child->in_fd = -1;
+		return;
+	}
+	ssize_t written = write(child->in_fd, child->input + child->input_pos, child->input_len - child->input_pos);
+	if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return; // These are not errors, retry
+	if (written == -1 && errno == EPIPE) {
+		// The child doesn't want the rest
+		check(close(child->in_fd), "closing stdin");
+		child->in_fd = -1;
+		return;
+	}
+	check(written, "writing to stdin");
+	child->input_pos += written;
+}
+
+static void read_data(struct buffer *buffer, int *fd) {
+	if (buffer->allocated == buffer->len)
+		buffer->data = realloc(buffer->data, buffer->allocated *= 2);
+	ssize_t result = read(*fd, buffer->data + buffer->len, buffer->allocated - buffer->len);
+	if (result == 0) {
+		check(close(*fd), "closing pipe");
+		*fd = -1;
+		return;
+	}
+	if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return; // Retry. These are not really errors.
+	check(result, "reading data");
+	buffer->len += result;
+}
+
+// Open the pidfd of the child. Older kernels don't have it, then we just wait at the end.
+static int pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+	int fd = syscall(SYS_pidfd_open, pid, 0);
+	if (fd != -1) {
+		int flags = fcntl(fd, F_GETFD, 0);
+		if (flags != -1)
+			fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+	}
+	return fd;
+#else
+	(void) pid;
+	return -1;
+#endif
+}
+
+static void child_start(struct child *child) {
+	/*
+	 * Prepare the pipes. They are close-on-exec, so the other commands
+	 * started at the same time don't inherit them (and don't keep them
+	 * open). The ones installed as stdin, stdout and stderr by dup2 are
+	 * not.
+	 */
+	int in_pipes[2], out_pipes[2], err_pipes[2];
+	check(pipe2(in_pipes, O_CLOEXEC), "creating stdin pipe");
+	check(pipe2(out_pipes, O_CLOEXEC), "creating stdout pipe");
+	check(pipe2(err_pipes, O_CLOEXEC), "creating stderr pipe");
+
+	/*
+	 * Start the sub process. We have a lot of memory mapped (all the
+	 * plugins, models and documents), so copying the page tables by fork
+	 * would be expensive. The posix_spawn doesn't need to do that
+	 * (it uses vfork-like clone in the libc).
+	 */
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attrs;
+	checke(posix_spawn_file_actions_init(&actions), "preparing spawn");
+	checke(posix_spawnattr_init(&attrs), "preparing spawn attributes");
+	/*
+	 * Own process group, so we can kill the whole pipeline in case of timeout.
+	 * Also, the worker threads have all the signals blocked, the command
+	 * must not inherit that (it would ignore our SIGTERM). And the server
+	 * ignores SIGPIPE, the commands expect the default (for pipelines
+	 * like `… | head` to stop).
+	 */
+	checke(posix_spawnattr_setflags(&attrs, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF), "setting spawn flags");
+	checke(posix_spawnattr_setpgroup(&attrs, 0), "setting process group");
+	sigset_t mask;
+	sigemptyset(&mask);
+	checke(posix_spawnattr_setsigmask(&attrs, &mask), "setting signal mask");
+	sigset_t defaults;
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGPIPE);
+	checke(posix_spawnattr_setsigdefault(&attrs, &defaults), "setting default signals");
+	checke(posix_spawn_file_actions_adddup2(&actions, in_pipes[0], 0), "preparing stdin");
+	checke(posix_spawn_file_actions_adddup2(&actions, out_pipes[1], 1), "preparing stdout");
+	checke(posix_spawn_file_actions_adddup2(&actions, err_pipes[1], 2), "preparing stderr");
+	clock_gettime(CLOCK_MONOTONIC, &child->start);
+	int spawn_error = posix_spawnp(&child->pid, child->argv[0], &actions, &attrs, child->argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attrs);
+	// OK, we are in the parent now. Close the child ends of pipes.
+	check(close(in_pipes[0]), "closing child stdin");
+	check(close(out_pipes[1]), "closing child stdout");
+	check(close(err_pipes[1]), "closing child stderr");
+	child->in_fd = in_pipes[1];
+	child->out_fd = out_pipes[0];
+	child->err_fd = err_pipes[0];
+	buffer_init(&child->out, child->stream ? STREAM_BUFFER : 1024);
+	buffer_init(&child->err, 1024);
+	child->pid_fd = -1;
+	if (spawn_error) {
+		/*
+		 * Pretend it was the command that failed, like when the shell
+		 * doesn't find the command.
+		 */
+		check(close(child->in_fd), "closing stdin");
+		check(close(child->out_fd), "closing stdout");
+		check(close(child->err_fd), "closing stderr");
+		child->in_fd = child->out_fd = child->err_fd = -1;
+		child->status = 127 << 8;
+		child->reaped = true;
+		int len = snprintf(NULL, 0, "Failed to run %s: %s\n", child->argv[0], strerror(spawn_error));
+		child->err.data = realloc(child->err.data, len + 1);
+		child->err.allocated = len + 1;
+		child->err.len = sprintf(child->err.data, "Failed to run %s: %s\n", child->argv[0], strerror(spawn_error));
+		return;
+	}
+	child->pid_fd = pidfd_open(child->pid);
+	// The sooner of our own timeout and the one of the whole RPC
+	uint64_t now = now_ms();
+	if (child->timeout)
+		child->deadline = now + child->timeout;
+	if (budget_deadline && (!child->deadline || budget_deadline < child->deadline)) {
+		child->deadline = budget_deadline;
+		child->over_budget = true;
+	}
+	// Set the rest non-blocking
+	unblock(child->in_fd);
+	unblock(child->out_fd);
+	unblock(child->err_fd);
+	// Try to write a bit of stdin right away (or close it, if there's no input)
+	child_feed(child);
+}
+
+// Collect the exit status of the child
+static void child_reap(struct child *child) {
+	check(waitpid(child->pid, &child->status, 0), "waiting for sub-process");
+	child->reaped = true;
+	if (child->pid_fd != -1) {
+		check(close(child->pid_fd), "closing pidfd");
+		child->pid_fd = -1;
+	}
+}
+
+static bool child_running(const struct child *child) {
+	return child->in_fd != -1 || child->out_fd != -1 || child->err_fd != -1;
+}
+
+/*
+ * Handle the deadline of the child, if it passed. First it is asked to
+ * terminate, then killed. If something still holds its pipes after that
+ * (something it started and that left its group), we stop waiting for
+ * them.
+ *
+ * Returns the next deadline, 0 if none.
+ */
+static uint64_t child_check_deadline(struct child *child, uint64_t now) {
+	// Nothing more to wait for (without pidfd, we can't wait for the termination in the loop)
+	if (!child_running(child) && (child->reaped || child->pid_fd == -1))
+		return 0;
+	if (!child->deadline || now < child->deadline)
+		return child->deadline;
+	switch (child->kill_stage ++) {
+		case 0:
+			nlog(NLOG_WARN, "Command %s took too long, terminating", child->argv[0]);
+			child->timed_out = true;
+			if (!child->reaped)
+				kill(-child->pid, SIGTERM);
+			break;
+		case 1:
+			nlog(NLOG_WARN, "Command %s doesn't terminate, killing", child->argv[0]);
+			if (!child->reaped)
+				kill(-child->pid, SIGKILL);
+			break;
+		default: {
+			int *fds[] = { &child->in_fd, &child->out_fd, &child->err_fd };
+			for (size_t i = 0; i < sizeof fds / sizeof *fds; i ++)
+				if (*fds[i] != -1) {
+					check(close(*fds[i]), "closing abandoned pipe");
+					*fds[i] = -1;
+				}
+			return child->deadline = 0;
+		}
+	}
+	return child->deadline = now + KILL_GRACE;
+}
+
+// Add the still open pipes of the child to the poll set. Returns how many were added.
+static size_t child_polls(const struct child *child, struct pollfd *polls) {
+	size_t count = 0;
+	if (child->in_fd != -1)
+		polls[count ++] = (struct pollfd) { .fd = child->in_fd, .events = POLLOUT };
+	// The streamed output waits until there's space for it
+	if (child->out_fd != -1 && !(child->stream && child->out.len == child->out.allocated))
+		polls[count ++] = (struct pollfd) { .fd = child->out_fd, .events = POLLIN };
+	if (child->err_fd != -1)
+		polls[count ++] = (struct pollfd) { .fd = child->err_fd, .events = POLLIN };
+	if (child->pid_fd != -1)
+		polls[count ++] = (struct pollfd) { .fd = child->pid_fd, .events = POLLIN };
+	return count;
+}
+
+static void child_handle(struct child *child, const struct pollfd *poll) {
+	if (!poll->revents)
+		return;
+	if (poll->fd == child->in_fd)
+		child_feed(child);
+	else if (poll->fd == child->out_fd)
+		read_data(&child->out, &child->out_fd);
+	else if (poll->fd == child->err_fd)
+		read_data(&child->err, &child->err_fd);
+	else if (poll->fd == child->pid_fd)
+		child_reap(child);
+}
+
+// Wait for the child to terminate (if it didn't yet), after all its pipes got closed.
+static void child_finish(struct child *child) {
+	if (!child->reaped)
+		child_reap(child);
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	nlog(NLOG_DEBUG, "Command %s took %ld ms", child->argv[0], (end.tv_sec - child->start.tv_sec) * 1000 + (end.tv_nsec - child->start.tv_nsec) / 1000000);
+}
+
+static void child_free(struct child *child) {
+	for (char **arg = child->argv; *arg; arg ++)
+		free(*arg);
+	free(child->argv);
+	free(child->out.data);
+	free(child->err.data);
+}
+
+/*
+ * Wait for something to happen with the children and handle it. Their
+ * pipes (and pidfds, so they are reaped as soon as they terminate) are
+ * handled in single poll. Returns false if there's nothing to wait for.
+ */
+static bool children_poll(struct child **children, size_t count) {
+	if (!count)
+		return false;
+	// Take care of the children that took too long and find out how long we may wait
+	uint64_t now = now_ms(), wake = 0;
+	for (size_t i = 0; i < count; i ++) {
+		uint64_t deadline = child_check_deadline(children[i], now);
+		if (deadline && (!wake || deadline < wake))
+			wake = deadline;
+	}
+	// Up to 3 pipes and the pidfd for each
+	struct pollfd polls[4 * count];
+	struct child *owners[4 * count];
+	size_t poll_count = 0;
+	for (size_t i = 0; i < count; i ++) {
+		size_t added = child_polls(children[i], polls + poll_count);
+		for (size_t j = 0; j < added; j ++)
+			owners[poll_count + j] = children[i];
+		poll_count += added;
+	}
+	if (!poll_count)
+		return false; // All closed
+	int result = poll(polls, poll_count, wake ? (int) (wake - now) : -1);
+	if (result == -1 && errno == EINTR)
+		return true; // Retry
+	check(result, "polling commands");
+	for (size_t i = 0; i < poll_count; i ++)
+		child_handle(owners[i], &polls[i]);
+	return true;
+}
+
+// Run all the children at once and wait for all of them to terminate.
+static void children_run(struct child *children, size_t count) {
+	struct child *pointers[count ? count : 1];
+	for (size_t i = 0; i < count; i ++) {
+		child_start(&children[i]);
+		pointers[i] = &children[i];
+	}
+	while (children_poll(pointers, count))
+		;
+	for (size_t i = 0; i < count; i ++) {
+		assert(!child_running(&children[i]));
+		child_finish(&children[i]);
+	}
+}
+
+// Read the timeout (in seconds) from the table at the index
+static uint64_t get_timeout(lua_State *lua, int index) {
+	lua_getfield(lua, index, "timeout");
+	uint64_t timeout = 0;
+	if (lua_isnumber(lua, -1) && lua_tonumber(lua, -1) > 0)
+		timeout = lua_tonumber(lua, -1) * 1000;
+	lua_pop(lua, 1);
+	return timeout;
+}
+
+// Registry field with the error raised when the budget runs out
+#define BUDGET_ERROR "nuci.budget_error"
+
+void commands_push_budget_error(lua_State *lua) {
+	lua_getfield(lua, LUA_REGISTRYINDEX, BUDGET_ERROR);
+}
+
+static int budget_error(lua_State *lua) {
+	commands_push_budget_error(lua);
+	return lua_error(lua);
+}
+
+static void check_budget(lua_State *lua) {
+	if (budget_deadline && now_ms() >= budget_deadline)
+		budget_error(lua);
+}
+
+/*
+ * Fill the child from the parameters of run_command (the input or options
+ * and the command with parameters). The input points into lua strings, so
+ * it is valid only during the call.
+ */
+static void child_from_params(lua_State *lua, struct child *child, const char *name) {
+	int param_count = lua_gettop(lua);
+	if (param_count < 2)
+		luaL_error(lua, "%s expects at least 2 parameters, %d given", name, param_count);
+	check_budget(lua);
+
+	*child = (struct child) { .input = "" };
+	// Extract the stdin and options
+	if (lua_istable(lua, 1)) {
+		lua_getfield(lua, 1, "input");
+		// The string stays alive, as it is referenced from the table we got
+		if (lua_isstring(lua, -1))
+			child->input = lua_tolstring(lua, -1, &child->input_len);
+		lua_pop(lua, 1);
+		child->timeout = get_timeout(lua, 1);
+	} else if (!lua_isnil(lua, 1)) {
+		child->input = lua_tolstring(lua, 1, &child->input_len);
+	}
+
+	// Extract the argv. Param 2 (the command) belongs there too.
+	child->argv = malloc(param_count * sizeof *child->argv); // One less for stdin, one more for NULL
+	for (int i = 0; i < param_count - 1; i ++) // Lua insists on ints, even if size_t is theoretically more correct
+		child->argv[i] = strdup(lua_tostring(lua, i + 2));
+	child->argv[param_count - 1] = NULL;
+}
+
+/*
+ * Commands started from a get running as a coroutine (see
+ * interpreter_get_docs) don't block. The command is packed into a pending
+ * object, which is yielded to the scheduler. It starts it and polls it
+ * together with the commands of the other coroutines, then resumes the
+ * coroutine with the results.
+ */
+#define WRAP_PENDING "nuci.pending"
+// Registry table, thread -> true if it may yield
+#define ASYNC_THREADS "nuci.async_threads"
+
+struct commands_pending {
+	bool multi; // From run_commands (results in a table) or run_command
+	bool started, finished;
+	size_t count;
+	struct child children[];
+};
+
+static struct commands_pending *pending_new(lua_State *lua, size_t count, bool multi) {
+	struct commands_pending *pending = lua_newuserdata(lua, sizeof *pending + count * sizeof *pending->children);
+	*pending = (struct commands_pending) {
+		.multi = multi,
+		.count = count
+	};
+	memset(pending->children, 0, count * sizeof *pending->children);
+	luaL_getmetatable(lua, WRAP_PENDING);
+	lua_setmetatable(lua, -2);
+	return pending;
+}
+
+// Kill the children and free them. Used when the pending is dropped before it completes.
+static void child_abandon(struct child *child) {
+	if (!child->reaped)
+		kill(-child->pid, SIGKILL);
+	int *fds[] = { &child->in_fd, &child->out_fd, &child->err_fd, &child->pid_fd };
+	for (size_t i = 0; i < sizeof fds / sizeof *fds; i ++)
+		if (*fds[i] != -1)
+			close(*fds[i]);
+	if (!child->reaped)
+		waitpid(child->pid, &child->status, 0);
+}
+
+static int pending_gc(lua_State *lua) {
+	struct commands_pending *pending = luaL_checkudata(lua, 1, WRAP_PENDING);
+	if (pending->finished)
+		return 0;
+	for (size_t i = 0; i < pending->count; i ++) {
+		if (pending->started)
+			child_abandon(&pending->children[i]);
+		if (pending->children[i].argv)
+			child_free(&pending->children[i]);
+	}
+	pending->finished = true;
+	return 0;
+}
+
+// Look up the thread in the table of async threads. Pushes the value.
+static void async_lookup(lua_State *lua, lua_State *thread) {
+	lua_getfield(lua, LUA_REGISTRYINDEX, ASYNC_THREADS);
+	lua_pushthread(thread);
+	if (thread != lua)
+		lua_xmove(thread, lua, 1);
+	lua_rawget(lua, -2);
+	lua_remove(lua, -2);
+}
+
+static void async_set(lua_State *thread, bool value) {
+	lua_getfield(thread, LUA_REGISTRYINDEX, ASYNC_THREADS);
+	lua_pushthread(thread);
+	lua_pushboolean(thread, value);
+	lua_rawset(thread, -3);
+	lua_pop(thread, 1);
+}
+
+/*
+ * Can the caller of the current C function yield? Lua 5.1 can't yield
+ * across a C call. That is a C function on the stack (pcall, table.sort,
+ * ...), but also a lua function called from inside the VM (a metamethod or
+ * the iterator of a generic for). Such a function doesn't get a name from
+ * the call instruction of its caller, while the ordinary calls do. The only
+ * other unnamed functions are the body of the coroutine and the tail calls.
+ *
+ * A function called in an unusual way (eg. t[1]()) has no name either. We
+ * don't yield from it, which costs only the parallelism.
+ */
+static bool yield_possible(lua_State *lua) {
+	lua_Debug ar;
+	// Level 0 is the C function itself
+	for (int level = 1; lua_getstack(lua, level, &ar); level ++) {
+		if (!lua_getinfo(lua, "Sn", &ar) || strcmp(ar.what, "C") == 0)
+			return false;
+		if (strcmp(ar.what, "tail") == 0)
+			continue;
+		if (ar.name && strcmp(ar.name, "(for generator)") == 0)
+			return false;
+		if (!*ar.namewhat) {
+			lua_Debug caller;
+			if (lua_getstack(lua, level + 1, &caller) && (!lua_getinfo(lua, "S", &caller) || strcmp(caller.what, "tail") != 0))
+				return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * May the command yield instead of waiting? If the thread is async but the
+ * yield is not possible here, the command just runs the usual way, inside
+ * the coroutine.
+ */
+static bool may_yield(lua_State *lua) {
+	async_lookup(lua, lua);
+	bool result = lua_toboolean(lua, -1);
+	lua_pop(lua, 1);
+	return result && yield_possible(lua);
+}
+
+void commands_mark_async(lua_State *thread) {
+	async_set(thread, true);
+}
+
+// Yield the pending on top of the stack. Nothing is started yet.
+static int pending_yield(lua_State *lua) {
+	return lua_yield(lua, 1);
+}
+
+struct commands_pending *commands_yielded(lua_State *thread) {
+	struct commands_pending *pending = NULL;
+	if (lua_gettop(thread) && lua_getmetatable(thread, -1)) {
+		luaL_getmetatable(thread, WRAP_PENDING);
+		if (lua_rawequal(thread, -1, -2))
+			pending = lua_touserdata(thread, -3);
+		lua_pop(thread, 2);
+	}
+	return pending;
+}
+
+void commands_pending_start(struct commands_pending *pending) {
+	for (size_t i = 0; i < pending->count; i ++)
+		child_start(&pending->children[i]);
+	pending->started = true;
+}
+
+bool commands_pending_done(const struct commands_pending *pending) {
+	for (size_t i = 0; i < pending->count; i ++) {
+		const struct child *child = &pending->children[i];
+		if (child_running(child) || child->pid_fd != -1)
+			return false;
+	}
+	return true;
+}
+
+void commands_pending_poll(struct commands_pending *const *pendings, size_t count) {
+	size_t total = 0;
+	for (size_t i = 0; i < count; i ++)
+		total += pendings[i]->count;
+	struct child *children[total ? total : 1];
+	size_t pos = 0;
+	for (size_t i = 0; i < count; i ++)
+		for (size_t j = 0; j < pendings[i]->count; j ++)
+			children[pos ++] = &pendings[i]->children[j];
+	children_poll(children, total);
+}
+
+// Push the results of run_command
+static int push_result(lua_State *lua, const struct child *child) {
+	lua_pushnumber(lua, child->status);
+	lua_pushlstring(lua, child->out.data, child->out.len);
+	lua_pushlstring(lua, child->err.data, child->err.len);
+	lua_pushboolean(lua, child->timed_out);
+	return 4;
+}
+
+// Push the results of run_commands
+static int push_results(lua_State *lua, const struct child *children, size_t count) {
+	lua_createtable(lua, count, 0);
+	for (size_t i = 0; i < count; i ++) {
+		lua_createtable(lua, 0, 4);
+		lua_pushnumber(lua, children[i].status);
+		lua_setfield(lua, -2, "code");
+		lua_pushlstring(lua, children[i].out.data, children[i].out.len);
+		lua_setfield(lua, -2, "stdout");
+		lua_pushlstring(lua, children[i].err.data, children[i].err.len);
+		lua_setfield(lua, -2, "stderr");
+		lua_pushboolean(lua, children[i].timed_out);
+		lua_setfield(lua, -2, "timed_out");
+		lua_rawseti(lua, -2, i + 1);
+	}
+	return 1;
+}
+
+static bool children_over_budget(const struct child *children, size_t count) {
+	for (size_t i = 0; i < count; i ++)
+		if (children[i].timed_out && children[i].over_budget)
+			return true;
+	return false;
+}
+
+int commands_pending_push(lua_State *thread, struct commands_pending *pending) {
+	for (size_t i = 0; i < pending->count; i ++)
+		child_finish(&pending->children[i]);
+	int result = -1;
+	if (!children_over_budget(pending->children, pending->count)) {
+		if (pending->multi)
+			result = push_results(thread, pending->children, pending->count);
+		else
+			result = push_result(thread, &pending->children[0]);
+		// Drop the pending from below the results
+		lua_remove(thread, -result - 1);
+	} else {
+		lua_pop(thread, 1);
+	}
+	for (size_t i = 0; i < pending->count; i ++)
+		child_free(&pending->children[i]);
+	pending->finished = true;
+	return result;
+}
+
+/*
+ * Run an external command.
+ *
+ * First argument is a string to put to the commands stdin. May be
+ * nil or empty string. It may also be a table with options:
+ * - input: The string for stdin.
+ * - timeout: Number of seconds after which the command is terminated.
+ *
+ * The rest of parameters are the command and its parameters. The first one is taken
+ * as the command.
+ *
+ * Returns (ecode, stdout, stderr, timed_out). First is number, the other too are
+ * strings. If the command was terminated because of the timeout, the output is what
+ * it produced until then and timed_out is true.
+ *
+ * If the time budget of the current RPC runs out, an error is raised.
+ */
+static int run_command_lua(lua_State *lua) {
+	struct child child;
+	child_from_params(lua, &child, "run_command");
+
+	if (may_yield(lua)) {
+		/*
+		 * The parameters stay on our part of the stack while we are
+		 * suspended, so the input is still valid when the command starts.
+		 */
+		struct commands_pending *pending = pending_new(lua, 1, false);
+		pending->children[0] = child;
+		return pending_yield(lua);
+	}
+
+	children_run(&child, 1);
+
+	bool over_budget = children_over_budget(&child, 1);
+	// Output the data.
+	int result = push_result(lua, &child);
+	child_free(&child);
+	if (over_budget)
+		return budget_error(lua);
+	return result;
+}
+
+/*
+ * Run multiple external commands at once.
+ *
+ * The only argument is a table of commands. Each command is a table with
+ * the command and its parameters, optionally with the input for the stdin
+ * in the input field and timeout (in seconds) in the timeout field, like:
+ *
+ *   { { 'uname', '-r' }, { 'grep', 'x', input = 'xyz', timeout = 2 } }
+ *
+ * All the commands are started and waited for together, so it takes only
+ * as long as the slowest of them.
+ *
+ * Returns a table with results, in the same order as the commands. Each
+ * result is a table with fields code, stdout, stderr and timed_out (the
+ * same as the results of run_command).
+ */
+static int run_commands_lua(lua_State *lua) {
+	luaL_checktype(lua, 1, LUA_TTABLE);
+	check_budget(lua);
+	size_t count = lua_objlen(lua, 1);
+	// Check everything first, so we don't leave anything running on error.
+	for (size_t i = 1; i <= count; i ++) {
+		lua_rawgeti(lua, 1, i);
+		if (!lua_istable(lua, -1))
+			return luaL_error(lua, "Command %d passed to run_commands is not a table", (int) i);
+		size_t argc = lua_objlen(lua, -1);
+		if (!argc)
+			return luaL_error(lua, "Command %d passed to run_commands is empty", (int) i);
+		for (size_t j = 1; j <= argc; j ++) {
+			lua_rawgeti(lua, -1, j);
+			if (!lua_isstring(lua, -1))
+				return luaL_error(lua, "Parameter %d of command %d is not a string", (int) j, (int) i);
+			lua_pop(lua, 1);
+		}
+		lua_pop(lua, 1);
+	}
+
+	bool yield = may_yield(lua);
+	struct commands_pending *pending = NULL;
+	struct child *children;
+	if (yield) {
+		pending = pending_new(lua, count, true);
+		children = pending->children;
+	} else {
+		children = calloc(count, sizeof *children);
+	}
+	for (size_t i = 0; i < count; i ++) {
+		struct child *child = &children[i];
+		lua_rawgeti(lua, 1, i + 1);
+		size_t argc = lua_objlen(lua, -1);
+		child->argv = malloc((argc + 1) * sizeof *child->argv);
+		for (size_t j = 0; j < argc; j ++) {
+			lua_rawgeti(lua, -1, j + 1);
+			child->argv[j] = strdup(lua_tostring(lua, -1));
+			lua_pop(lua, 1);
+		}
+		child->argv[argc] = NULL;
+		// The string stays alive, as it is referenced from the table we got
+		lua_getfield(lua, -1, "input");
+		if (lua_isstring(lua, -1))
+			child->input = lua_tolstring(lua, -1, &child->input_len);
+		else
+			child->input = "";
+		lua_pop(lua, 1);
+		child->timeout = get_timeout(lua, -1);
+		lua_pop(lua, 1);
+	}
+	if (yield)
+		return pending_yield(lua);
+
+	children_run(children, count);
+
+	bool over_budget = children_over_budget(children, count);
+	push_results(lua, children, count);
+	for (size_t i = 0; i < count; i ++)
+		child_free(&children[i]);
+	free(children);
+	if (over_budget)
+		return budget_error(lua);
+	return 1;
+}
+
+#define WRAP_PROC "nuci.proc"
+
+// A command with streamed output, as seen from lua
+struct proc {
+	struct child child;
+	char *input; // Our copy, the child's input points here
+	size_t position; // How much of the output buffer was consumed already
+	bool finished;
+};
+
+static struct proc *to_proc(lua_State *lua, int index) {
+	return luaL_checkudata(lua, index, WRAP_PROC);
+}
+
+// The iterator returned from run_command_lines. Returns the next line of output.
+static int proc_next_line(lua_State *lua) {
+	struct proc *proc = to_proc(lua, lua_upvalueindex(1));
+	struct child *child = &proc->child;
+	struct buffer *out = &child->out;
+	if (proc->finished)
+		return 0;
+	luaL_Buffer line;
+	luaL_buffinit(lua, &line);
+	bool partial = false;
+	for (;;) {
+		const char *start = out->data + proc->position;
+		const char *newline = memchr(start, '\n', out->len - proc->position);
+		if (newline) {
+			luaL_addlstring(&line, start, newline - start);
+			proc->position = newline - out->data + 1;
+			luaL_pushresult(&line);
+			return 1;
+		}
+		/*
+		 * No complete line in the buffer. Keep what there is (the line may
+		 * be longer than the buffer) and make space for more.
+		 */
+		if (out->len > proc->position) {
+			luaL_addlstring(&line, start, out->len - proc->position);
+			partial = true;
+		}
+		out->len = proc->position = 0;
+		if (child->out_fd == -1) {
+			// The end of the output. The last line may lack the newline.
+			if (partial) {
+				luaL_pushresult(&line);
+				return 1;
+			}
+			return 0;
+		}
+		children_poll(&child, 1);
+	}
+}
+
+/*
+ * proc:finish()
+ *
+ * Wait for the command to terminate, skipping the rest of its output.
+ * Returns (ecode, stderr, timed_out), like run_command (without the stdout).
+ */
+static int proc_finish(lua_State *lua) {
+	struct proc *proc = to_proc(lua, 1);
+	struct child *child = &proc->child;
+	if (!proc->finished) {
+		do
+			child->out.len = proc->position = 0; // Nobody is interested in the rest of the output
+		while (children_poll(&child, 1));
+		child_finish(child);
+		proc->finished = true;
+	}
+	if (child->timed_out && child->over_budget)
+		return budget_error(lua);
+	lua_pushnumber(lua, child->status);
+	lua_pushlstring(lua, child->err.data, child->err.len);
+	lua_pushboolean(lua, child->timed_out);
+	return 3;
+}
+
+// The command is forgotten without waiting for it, kill it.
+static int proc_gc(lua_State *lua) {
+	struct proc *proc = to_proc(lua, 1);
+	struct child *child = &proc->child;
+	if (!proc->finished)
+		child_abandon(child);
+	child_free(child);
+	free(proc->input);
+	return 0;
+}
+
+static const luaL_Reg proc_methods[] = {
+	{ "finish", proc_finish },
+	{ "__gc", proc_gc },
+	{ NULL, NULL }
+};
+
+/*
+ * Run an external command and read its output line by line, as it comes.
+ * Only a small part of the output is held in memory at any time, so it is
+ * suitable for commands with large output.
+ *
+ * The parameters are the same as with run_command.
+ *
+ * Returns an iterator over the lines of the output (without the newlines)
+ * and an object representing the command. Call its finish() method after
+ * reading the output, to get the exit code (and the stderr and timed_out,
+ * like with run_command). Like:
+ *
+ *   local iter, proc = run_command_lines(nil, 'ip', 'neighbour');
+ *   for line in iter do
+ *     ...
+ *   end
+ *   local ecode, stderr = proc:finish();
+ *
+ * If the object is dropped before finish() is called, the command is killed.
+ */
+static int run_command_lines_lua(lua_State *lua) {
+	struct child child;
+	child_from_params(lua, &child, "run_command_lines");
+	struct proc *proc = lua_newuserdata(lua, sizeof *proc);
+	*proc = (struct proc) {
+		.child = child
+	};
+	// The lua strings may be gone by the time we write them to the command
+	proc->input = malloc(child.input_len + 1);
+	memcpy(proc->input, child.input, child.input_len);
+	proc->child.input = proc->input;
+	proc->child.stream = true;
+	luaL_getmetatable(lua, WRAP_PROC);
+	lua_setmetatable(lua, -2);
+	child_start(&proc->child);
+	// The iterator, with the proc as its upvalue
+	lua_pushvalue(lua, -1);
+	lua_pushcclosure(lua, proc_next_line, 1);
+	lua_insert(lua, -2);
+	return 2;
+}
+
+void commands_init(lua_State *L) {
+	lua_register(L, "run_command", run_command_lua);
+	lua_register(L, "run_commands", run_commands_lua);
+	lua_register(L, "run_command_lines", run_command_lines_lua);
+	luaL_newmetatable(L, WRAP_PROC);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_register(L, NULL, proc_methods);
+	lua_pop(L, 1);
+	luaL_newmetatable(L, WRAP_PENDING);
+	lua_pushcfunction(L, pending_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	// The threads are in the table only while they live
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, ASYNC_THREADS);
+	/*
+	 * The budget error is a table in the usual error format, so it makes
+	 * its own netconf error. It is the same table every time, so lua code
+	 * can recognize it (as the budget_exceeded global) and not hide it.
+	 */
+	lua_newtable(L);
+	lua_pushliteral(L, "Time budget of the RPC exceeded");
+	lua_setfield(L, -2, "msg");
+	lua_pushliteral(L, "operation-failed");
+	lua_setfield(L, -2, "tag");
+	lua_pushliteral(L, "budget-exceeded");
+	lua_setfield(L, -2, "app_tag");
+	lua_pushvalue(L, -1);
+	lua_setglobal(L, "budget_exceeded");
+	lua_setfield(L, LUA_REGISTRYINDEX, BUDGET_ERROR);
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2013, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of NUCI configuration server.
+ *
+ * NUCI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * NUCI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NUCI_COMMANDS_H
+#define NUCI_COMMANDS_H
+
+#include <lua.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Running of external commands from lua. Registers the run_command,
+ * run_commands and run_command_lines functions.
+ */
+void commands_init(lua_State *L);
+
+/*
+ * Set the time budget for all the commands started from now on. When it
+ * runs out, the commands are terminated and an error is raised in the lua
+ * code that started them. Zero or negative value removes the limit.
+ *
+ * The error is always the same table (available as the budget_exceeded
+ * global in lua), with the budget-exceeded app_tag.
+ */
+void commands_set_budget(int seconds);
+// Push the error value of an exceeded budget to the stack.
+void commands_push_budget_error(lua_State *lua);
+
+/*
+ * Support for running the lua code in coroutines, with the commands of
+ * several coroutines running at once.
+ *
+ * When a thread is marked as async, run_command and run_commands called in
+ * it don't wait for the commands. They yield a pending object instead. The
+ * caller of lua_resume starts it, polls it (possibly together with pending
+ * objects of other threads), pushes the results and resumes the thread with
+ * them. Where the thread can't yield (inside pcall, for example), they wait
+ * for the commands as usual.
+ *
+ * The run_command_lines still waits for its command, since the iterator can't
+ * yield anyway.
+ */
+struct commands_pending;
+
+void commands_mark_async(lua_State *thread);
+/*
+ * Get the pending object the thread yielded, or NULL if it yielded
+ * something else.
+ */
+struct commands_pending *commands_yielded(lua_State *thread);
+void commands_pending_start(struct commands_pending *pending);
+bool commands_pending_done(const struct commands_pending *pending);
+// Wait until something happens with any of the pending objects.
+void commands_pending_poll(struct commands_pending *const *pendings, size_t count);
+/*
+ * Push the results of the done pending object to the thread, replacing the
+ * pending object. Returns the number of the results, or -1 if the time
+ * budget of the RPC ran out (and there are no results).
+ */
+int commands_pending_push(lua_State *thread, struct commands_pending *pending);
+
+#endif
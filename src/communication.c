@@ -22,24 +22,36 @@
 #include "register.h"
 #include "interpreter.h"
 #include "model.h"
+#include "filter.h"
+#include "commands.h"
+#include "workers.h"
 #include "logging.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include <libnetconf.h>
+#include <libnetconf_xml.h>
 #include <libnetconf/datastore_custom.h>
 
+#include <libxml/tree.h>
+#include <libxml/parser.h>
+
 #define LUA_PLUGIN_PATH PLUGIN_PATH "/lua_plugins"
 
 // One data store
 struct datastore {
 	ncds_id id;
 	struct ncds_ds *datastore;
-	char *ns;
+	const char *ns; // Owned by the model registry
 	lua_datastore lua;
+	// The state fetched in advance for the current request (see states_prefetch)
+	bool prefetched;
+	xmlDocPtr state;
+	struct nc_err *state_error;
 };
 
 /**
@@ -68,36 +80,157 @@ void comm_set_print_error_callback(void(*clb)(const char *message)) {
 	clb_print_error = clb;
 }
 
-static char *get_ds_stats(const char *model, const char *running, struct nc_err **e) {
-	(void) running;
-	char *model_uri = extract_model_uri_string(model);
-	lua_datastore datastore;
-	bool found = false;
-	for (size_t i = 0; i < global_srv_config.config_datastore_count; i ++)
-		if (strcmp(model_uri, global_srv_config.config_datastores[i].ns) == 0) {
-			found = true;
-			datastore = global_srv_config.config_datastores[i].lua;
-			break;
-		}
-	free(model_uri);
-	assert(found); // We should not be called with namespace we don't know
+// The FNV-1a hash of the namespace
+static size_t ns_hash(const char *ns) {
+	uint32_t hash = 2166136261U;
+	for (const unsigned char *c = (const unsigned char *) ns; *c; c ++) {
+		hash ^= *c;
+		hash *= 16777619U;
+	}
+	return hash;
+}
 
-	const char *result = interpreter_get(global_srv_config.interpreter, datastore, "get");
-	if ((*e = nc_err_create_from_lua(global_srv_config.interpreter, *e))) {
+static struct datastore *datastore_lookup(const struct srv_config *config, const char *ns) {
+	if (!ns || !config->ns_index)
 		return NULL;
-	} else {
-		return strdup(result);
+	for (size_t pos = ns_hash(ns) & config->ns_index_mask; config->ns_index[pos]; pos = (pos + 1) & config->ns_index_mask)
+		if (strcmp(config->ns_index[pos]->ns, ns) == 0)
+			return config->ns_index[pos];
+	return NULL;
+}
+
+/*
+ * Build the namespace index. Keep it at most half full, so the chains
+ * of collisions stay short.
+ */
+static void ns_index_build(struct srv_config *config) {
+	size_t size = 4;
+	while (size < 2 * config->config_datastore_count)
+		size *= 2;
+	config->ns_index = calloc(size, sizeof *config->ns_index);
+	config->ns_index_mask = size - 1;
+	for (size_t i = 0; i < config->config_datastore_count; i ++) {
+		struct datastore *datastore = &config->config_datastores[i];
+		if (datastore_lookup(config, datastore->ns)) {
+			nlog(NLOG_WARN, "Multiple data stores with namespace %s, using the first one", datastore->ns);
+			continue;
+		}
+		size_t pos = ns_hash(datastore->ns) & config->ns_index_mask;
+		while (config->ns_index[pos])
+			pos = (pos + 1) & config->ns_index_mask;
+		config->ns_index[pos] = datastore;
+	}
+}
+
+/*
+ * Get the state data of the data store. If it was prefetched, take the
+ * prefetched one, otherwise call the get right now.
+ */
+static xmlDocPtr datastore_state(struct srv_config *config, struct datastore *datastore, const xmlNode *filter, struct nc_err **e) {
+	if (datastore->prefetched) {
+		xmlDocPtr state = datastore->state;
+		*e = datastore->state_error;
+		datastore->prefetched = false;
+		datastore->state = NULL;
+		datastore->state_error = NULL;
+		return state;
+	}
+	xmlDocPtr state = interpreter_get_doc(config->interpreter, datastore->lua, "get_cached", filter);
+	if ((*e = nc_err_create_from_lua(config->interpreter, NULL)) && state) {
+		xmlFreeDoc(state);
+		state = NULL;
+	}
+	return state;
+}
+
+/*
+ * Get the state of all the data stores the filter selects at once, before
+ * they are asked for one by one. The get methods run concurrently (see
+ * interpreter_get_docs), so the external commands they run overlap. If
+ * there are worker threads, the data stores are spread between them.
+ */
+static void states_prefetch(struct srv_config *config) {
+	size_t count = config->config_datastore_count;
+	if (!count)
+		return;
+	struct datastore *selected[count];
+	lua_datastore datastores[count];
+	const char *namespaces[count];
+	const xmlNode *filters[count];
+	xmlDocPtr docs[count];
+	struct nc_err *errors[count];
+	size_t used = 0;
+	for (size_t i = 0; i < count; i ++) {
+		struct datastore *datastore = &config->config_datastores[i];
+		if (!filter_selects(config->filter, datastore->ns))
+			continue;
+		selected[used] = datastore;
+		datastores[used] = datastore->lua;
+		namespaces[used] = datastore->ns;
+		filters[used] = filter_subtree(config->filter, datastore->ns);
+		used ++;
+	}
+	if (config->workers)
+		workers_get_docs(config->workers, used, namespaces, filters, docs, errors);
+	else
+		interpreter_get_docs(config->interpreter, used, datastores, "get_cached", filters, docs, errors);
+	for (size_t i = 0; i < used; i ++) {
+		selected[i]->prefetched = true;
+		selected[i]->state = docs[i];
+		selected[i]->state_error = errors[i];
 	}
+}
 
-	return strdup(result);
+// Drop the prefetched states nobody asked for
+static void states_drop(struct srv_config *config) {
+	for (size_t i = 0; i < config->config_datastore_count; i ++) {
+		struct datastore *datastore = &config->config_datastores[i];
+		if (!datastore->prefetched)
+			continue;
+		if (datastore->state)
+			xmlFreeDoc(datastore->state);
+		if (datastore->state_error)
+			nc_err_free(datastore->state_error);
+		datastore->prefetched = false;
+		datastore->state = NULL;
+		datastore->state_error = NULL;
+	}
 }
 
-static bool config_ds_init(const char *datastore_model_path, struct datastore *datastore, lua_datastore lua_datastore, struct nuci_lock_info *lock_info, struct interpreter *interpreter, bool locking_enabled) {
+static xmlDocPtr get_ds_stats(const xmlDocPtr model, const xmlDocPtr running, struct nc_err **e) {
+	(void) running;
+	struct datastore *datastore = datastore_lookup(&global_srv_config, model_doc_ns(model));
+	assert(datastore); // We should not be called with namespace we don't know
+
+	const struct filter *filter = global_srv_config.filter;
+	// Nothing from this data store can get through the filter, don't bother
+	if (!filter_selects(filter, datastore->ns))
+		return NULL;
+
+	// The document is passed to libnetconf as it is, without serializing it
+	struct nc_err *error;
+	xmlDocPtr doc = datastore_state(&global_srv_config, datastore, filter_subtree(filter, datastore->ns), &error);
+	if (error) {
+		// Keep the first error
+		if (*e)
+			nc_err_free(error);
+		else
+			*e = error;
+		return NULL;
+	}
+	return doc;
+}
+
+static bool config_ds_init(const struct srv_config *config, const struct model *model, struct datastore *datastore, lua_datastore lua_datastore, bool locking_enabled) {
 	// Create a data store. The thind parameter is NULL, so <get> returns the same as
 	// <get-config> in this data store.
-	datastore->ns = extract_model_uri_file(datastore_model_path);
+	datastore->ns = model->ns;
 	datastore->lua = lua_datastore;
-	datastore->datastore = ncds_new(NCDS_TYPE_CUSTOM, datastore_model_path, get_ds_stats);
+	/*
+	 * The libnetconf takes only the path of the model, so it reads the file
+	 * on its own. We can at least make sure we don't parse it again.
+	 */
+	datastore->datastore = ncds_new2(NCDS_TYPE_CUSTOM, model->path, get_ds_stats);
 
 	if (datastore->datastore == NULL) {
 		clb_print_error("Datastore preparing failed.");
@@ -105,7 +238,7 @@ static bool config_ds_init(const char *datastore_model_path, struct datastore *d
 	}
 
 	// Set the callbacks
-	ncds_custom_set_data(datastore->datastore, nuci_ds_get_custom_data(lock_info, interpreter, lua_datastore, locking_enabled), ds_funcs);
+	ncds_custom_set_data(datastore->datastore, nuci_ds_get_custom_data(config, lua_datastore, datastore->ns, locking_enabled), ds_funcs);
 
 	// Activate datastore structure for use.
 	datastore->id = ncds_init(datastore->datastore);
@@ -121,6 +254,7 @@ bool comm_init(struct srv_config *config, struct interpreter *interpreter_) {
 	// Wipe it out, so we have NULLs everywhere we didn't set something yet
 	memset(config, 0, sizeof *config);
 	comm_test_values();
+	config->interpreter = interpreter_;
 
 	//Initialize libnetconf for system-wide usage. This initialization is shared across all the processes.
 	if (nc_init(0) == -1) {
@@ -128,7 +262,6 @@ bool comm_init(struct srv_config *config, struct interpreter *interpreter_) {
 		return false;
 	}
 
-	config->lock_info = lock_info_create();
 	bool locking_enabled = true;
 
 	size_t config_datastore_count;
@@ -136,10 +269,15 @@ bool comm_init(struct srv_config *config, struct interpreter *interpreter_) {
 	const char *const *datastore_paths = get_datastore_providers(&lua_datastores, &config_datastore_count);
 	config->config_datastores = calloc(config_datastore_count, sizeof *config->config_datastores);
 	for (size_t i = 0; i < config_datastore_count; i ++) {
-		char *filename = model_path(datastore_paths[i]);
-		bool result = config_ds_init(filename, &config->config_datastores[i], lua_datastores[i], config->lock_info, interpreter_, locking_enabled);
+		// Already parsed when the plugin registered the data store
+		const struct model *model = model_get(datastore_paths[i]);
+		assert(model);
+		/*
+		 * The data stores get the whole config, since the lock info belongs to
+		 * the session and is switched for each RPC (and so is the filter).
+		 */
+		bool result = config_ds_init(config, model, &config->config_datastores[i], lua_datastores[i], locking_enabled);
 		locking_enabled = false;
-		free(filename);
 		if (!result) {
 			comm_cleanup(config);
 			return false;
@@ -153,6 +291,13 @@ bool comm_init(struct srv_config *config, struct interpreter *interpreter_) {
 		config->config_datastore_count ++;
 	}
 
+	ns_index_build(config);
+
+	return true;
+}
+
+struct srv_session *comm_session_accept(struct srv_config *config, int input, int output, const char *username) {
+	(void) config;
 	/*
 	 * Register the basic capabilities into the list. Hardcode the values - unfortunately,
 	 * the libnetconf has constants for these, but does not publish them.
@@ -161,27 +306,42 @@ bool comm_init(struct srv_config *config, struct interpreter *interpreter_) {
 		"urn:ietf:params:netconf:base:1.0",
 		"urn:ietf:params:netconf:base:1.1",
 		"urn:ietf:params:netconf:capability:writable-running:1.0",
+		"urn:ietf:params:netconf:capability:xpath:1.0",
 		NULL
 	};
 	struct nc_cpblts *capabilities = nc_cpblts_new(caps);
 
+	struct srv_session *session = calloc(1, sizeof *session);
 	// Accept NETCONF session from a client.
-	config->session = nc_session_accept(capabilities);
+	if (username)
+		session->session = nc_session_accept_inout(capabilities, username, input, output);
+	else
+		session->session = nc_session_accept(capabilities);
 	// Capabilities are no longer needed
 	nc_cpblts_free(capabilities);
 
-	if (config->session == NULL) {
+	if (session->session == NULL) {
 		clb_print_error("Session not established.\n");
-		comm_cleanup(config);
-		return false;
+		free(session);
+		return NULL;
 	}
 
 	// Add to the list of sessions.
-	nc_session_monitor(config->session);
+	nc_session_monitor(session->session);
 
-	config->interpreter = interpreter_;
+	session->lock_info = lock_info_create();
 
-	return true;
+	return session;
+}
+
+void comm_session_free(struct srv_session *session) {
+	// Cleanup the session structure and free all the allocated resources
+	if (session->session)
+		nc_session_free(session->session);
+	// Closing the lock file releases the lock, if we hold it.
+	if (session->lock_info)
+		lock_info_free(session->lock_info);
+	free(session);
 }
 
 /*
@@ -209,166 +369,377 @@ static bool comm_send_reply(struct nc_session *session, struct rpc_communication
 	return true;
 }
 
-void comm_start_loop(const struct srv_config *config) {
-	bool loop = true; //Break is not enough for handling close-session request
-
-	while (loop) {
-		struct rpc_communication communication;
-		// Make sure there's no garbage if we don't set something in it.
-		memset(&communication, 0, sizeof communication);
+// Skip the <?xml ...?> declaration, if there's one.
+static const char *skip_xml_decl(const char *xml) {
+	while (*xml == ' ' || *xml == '\t' || *xml == '\n' || *xml == '\r')
+		xml ++;
+	if (strncmp(xml, "<?xml", 5) == 0) {
+		const char *end = strstr(xml, "?>");
+		if (end)
+			return end + 2;
+	}
+	return xml;
+}
 
-		//Check session status
-		NC_SESSION_STATUS session_status = nc_session_get_status(config->session);
-		if (session_status == NC_SESSION_STATUS_CLOSING  || session_status == NC_SESSION_STATUS_CLOSED || session_status == NC_SESSION_STATUS_ERROR) {
-			break;
+/*
+ * Move the top-level elements (the nodes and their siblings) from the source
+ * document into the data document. If there's already a top-level element
+ * of the same name and namespace (eg. config and state of the same data
+ * store), the content is merged into it. The nodes are adopted, not copied,
+ * the source is to be freed afterwards.
+ */
+static void data_adopt(xmlDocPtr data, xmlDocPtr source, xmlNodePtr nodes) {
+	xmlNodePtr next;
+	for (xmlNodePtr node = nodes; node; node = next) {
+		next = node->next;
+		if (node->type != XML_ELEMENT_NODE)
+			continue;
+		const xmlChar *ns = node->ns ? node->ns->href : NULL;
+		xmlNodePtr existing;
+		for (existing = data->children; existing; existing = existing->next)
+			if (existing->type == XML_ELEMENT_NODE && xmlStrEqual(existing->name, node->name) && xmlStrEqual(existing->ns ? existing->ns->href : NULL, ns))
+				break;
+		if (existing) {
+			xmlNodePtr child_next;
+			for (xmlNodePtr child = node->children; child; child = child_next) {
+				child_next = child->next;
+				// Unlinks it and fixes the namespaces for the new place
+				xmlDOMWrapAdoptNode(NULL, source, child, data, existing, 0);
+				xmlAddChild(existing, child);
+			}
+		} else {
+			xmlDOMWrapAdoptNode(NULL, source, node, data, NULL, 0);
+			xmlAddChild((xmlNodePtr) data, node);
 		}
+	}
+}
 
-		//Another NC_SESSION_STATUS option are:
-		//if (session_status == NC_SESSION_STATUS_DUMMY) //Not our case
-		//if (session_status == NC_SESSION_STATUS_WORKING) //All is OK, go ahead
-		//if (session_status == NC_SESSION_STATUS_STARTUP) //All is OK, go ahead
+// Parse the config (which may have multiple top-level elements) and merge it into data
+static bool data_add_config(xmlDocPtr data, const char *config_str, struct nc_err **e) {
+	config_str = skip_xml_decl(config_str);
+	if (!*config_str)
+		return true;
+	size_t len = strlen(config_str);
+	char *wrapped = malloc(len + 14);
+	sprintf(wrapped, "<data>%s</data>", config_str);
+	xmlDocPtr parsed = xmlReadMemory(wrapped, len + 13, "get_config", NULL, XML_PARSE_NOBLANKS | XML_PARSE_NSCLEAN);
+	free(wrapped);
+	if (!parsed) {
+		*e = nc_err_new(NC_ERR_OP_FAILED);
+		nc_err_set(*e, NC_ERR_PARAM_MSG, "Method get_config returned invalid XML");
+		return false;
+	}
+	data_adopt(data, parsed, xmlDocGetRootElement(parsed)->children);
+	xmlFreeDoc(parsed);
+	return true;
+}
 
+/*
+ * Collect the data of all the data stores, for evaluating the xpath
+ * filter. The result has the top-level elements of the data stores
+ * directly under the document node. In case of error, NULL is returned
+ * and the error is in *e.
+ */
+static xmlDocPtr xpath_collect(struct srv_config *config, bool with_state, struct nc_err **e) {
+	xmlDocPtr data = xmlNewDoc(BAD_CAST "1.0");
+	for (size_t i = 0; i < config->config_datastore_count; i ++) {
+		struct datastore *datastore = &config->config_datastores[i];
+		const char *config_str = interpreter_get(config->interpreter, datastore->lua, "get_config", NULL);
+		if ((*e = nc_err_create_from_lua(config->interpreter, NULL)))
+			goto ERROR;
+		if (config_str && !data_add_config(data, config_str, e))
+			goto ERROR;
+		if (with_state) {
+			xmlDocPtr state = datastore_state(config, datastore, NULL, e);
+			if (*e)
+				goto ERROR;
+			if (state) {
+				data_adopt(data, state, state->children);
+				xmlFreeDoc(state);
+			}
+		}
+	}
+	return data;
+ERROR:
+	xmlFreeDoc(data);
+	return NULL;
+}
 
-		//Process incoming requests
-		NC_MSG_TYPE msg_type = nc_session_recv_rpc(config->session, -1, &communication.msg);
-			//[in]	timeout	Timeout in milliseconds, -1 for infinite timeout, 0 for non-blocking
-		if (msg_type == NC_MSG_UNKNOWN) {
-			communication.reply = nc_reply_error(nc_err_new(NC_ERR_MALFORMED_MSG));
+/*
+ * Build the reply with the top-level elements of the data as the content.
+ * The libnetconf copies the nodes, but doesn't need to parse anything.
+ */
+static nc_reply *data_reply(xmlDocPtr data) {
+	if (!data->children)
+		return nc_reply_data("");
+	return ncxml_reply_data(data->children);
+}
 
-			clb_print_error("Broken message recieved");
-			if (!comm_send_reply(config->session, &communication)) {
-				break;
-			}
+/*
+ * Handle get or get-config with the xpath filter. The libnetconf doesn't
+ * support it, so we collect the data, evaluate the filter on the tree and
+ * serialize only what is selected.
+ */
+static nc_reply *xpath_get(struct srv_config *config, const nc_rpc *rpc, NC_OP op) {
+	if (op == NC_OP_GETCONFIG && nc_rpc_get_source(rpc) != NC_DATASTORE_RUNNING)
+		return nc_reply_error(nc_err_new(NC_ERR_OP_NOT_SUPPORTED));
+	struct nc_err *e = NULL;
+	xmlDocPtr data = xpath_collect(config, op == NC_OP_GET, &e);
+	if (!data)
+		return nc_reply_error(e);
+	const char *error;
+	xmlDocPtr selected = filter_xpath_apply(config->filter, data, &error);
+	xmlFreeDoc(data);
+	if (!selected) {
+		e = nc_err_new(NC_ERR_INVALID_VALUE);
+		nc_err_set(e, NC_ERR_PARAM_TYPE, "protocol");
+		nc_err_set(e, NC_ERR_PARAM_MSG, error);
+		return nc_reply_error(e);
+	}
+	nc_reply *reply = data_reply(selected);
+	xmlFreeDoc(selected);
+	return reply;
+}
 
-			continue;
+/*
+ * Handle <get/> without any filter, which is what the monitoring tools ask
+ * for all the time. The state documents of the data stores are moved into a
+ * single data document as they are, only the config strings need parsing.
+ * The reply is built from the document, so libnetconf doesn't parse the
+ * whole thing again.
+ */
+static nc_reply *full_get(struct srv_config *config) {
+	struct nc_err *e = NULL;
+	xmlDocPtr data = xmlNewDoc(BAD_CAST "1.0");
+	for (size_t i = 0; i < config->config_datastore_count; i ++) {
+		struct datastore *datastore = &config->config_datastores[i];
+		const char *config_str = interpreter_get(config->interpreter, datastore->lua, "get_config", NULL);
+		if ((e = nc_err_create_from_lua(config->interpreter, NULL)))
+			goto ERROR;
+		if (config_str && !data_add_config(data, config_str, &e))
+			goto ERROR;
+		xmlDocPtr state = datastore_state(config, datastore, NULL, &e);
+		if (e)
+			goto ERROR;
+		if (state) {
+			// A data store providing both config and state has them merged
+			data_adopt(data, state, state->children);
+			xmlFreeDoc(state);
 		}
+	}
+	nc_reply *reply = data_reply(data);
+	xmlFreeDoc(data);
+	return reply;
+ERROR:
+	xmlFreeDoc(data);
+	return nc_reply_error(e);
+}
 
-		//Get more informations about request
-		NC_RPC_TYPE req_type = nc_rpc_get_type(communication.msg);
-		NC_OP req_op = nc_rpc_get_op(communication.msg);
-
-		//Handle session request-class
-		if (req_type == NC_RPC_SESSION) {
-			switch(req_op) {
-			case NC_OP_CLOSESESSION:
-				//Stop loop is OK: session will be physically killed by comm_cleanup()
-				loop = false;
-				communication.reply = nc_reply_ok();
-				break;
+/*
+ * Is there a filter in the request? The unknown types of filter count too,
+ * so libnetconf can complain about them.
+ */
+static bool has_filter(const nc_rpc *rpc) {
+	struct nc_filter *filter = nc_rpc_get_filter(rpc);
+	if (!filter)
+		return false;
+	nc_filter_free(filter);
+	return true;
+}
 
-			default:
-				communication.reply = nc_reply_error(nc_err_new(NC_ERR_OP_NOT_SUPPORTED));
-				break;
-			}
-		} else if (req_type == NC_RPC_UNKNOWN) {
-			//User rpc is expected now
-
-			//libnetconf for all getters says: Caller is responsible for freeing the returned string with free().
-			char *ns = nc_rpc_get_ns(communication.msg);
-			char *rpc_procedure = nc_rpc_get_op_name(communication.msg);
-			char *rpc_data = nc_rpc_get_op_content(communication.msg);
-
-			bool ds_found = false;
-			communication.reply = NULL;
-
-			//find namespace
-			for (size_t i = 0; i < config->config_datastore_count; i ++) {
-				if (strcmp(ns, config->config_datastores[i].ns) == 0) {
-					ds_found = true;
-					char *xml = NULL;
-					char *xml_part = interpreter_process_user_rpc(config->interpreter, config->config_datastores[i].lua, rpc_procedure, rpc_data);
-					/*
-					 * We have the answer. However, we need to do some manual juggling
-					 * to generate the answer, since libnetconf wants to put <data> or <ok>
-					 * into everything.
-					 */
-					if (xml_part) {
-						if (strncmp("<?xml ", xml_part, 6) == 0) {
-							xml_part = strstr(xml_part, "?>");
-							xml_part = strchr(xml_part, '<');
-						}
-						const char *format = "<rpc-reply xmlns='urn:ietf:params:xml:ns:netconf:base:1.0'>%s</rpc-reply>";
-						int size = snprintf(NULL, 0, format, xml_part);
-						xml = malloc(size + 1);
-						snprintf(xml, size + 1, format, xml_part);
-						communication.reply = nc_reply_build(xml);
-						free(xml);
-					}
-					break;
-				}
-			}
+static bool session_alive(struct nc_session *session) {
+	NC_SESSION_STATUS session_status = nc_session_get_status(session);
+	//Another NC_SESSION_STATUS option are:
+	//if (session_status == NC_SESSION_STATUS_DUMMY) //Not our case
+	//if (session_status == NC_SESSION_STATUS_WORKING) //All is OK, go ahead
+	//if (session_status == NC_SESSION_STATUS_STARTUP) //All is OK, go ahead
+	return !(session_status == NC_SESSION_STATUS_CLOSING  || session_status == NC_SESSION_STATUS_CLOSED || session_status == NC_SESSION_STATUS_ERROR);
+}
 
-			//Unknown datastore
-			if (!ds_found) {
-				communication.reply = nc_reply_error(nc_err_new(NC_ERR_UNKNOWN_NS));
+static enum comm_result process_rpc(struct srv_config *config, int timeout) {
+	bool closing = false; //The close-session request still needs a reply
+	struct rpc_communication communication;
+	// Make sure there's no garbage if we don't set something in it.
+	memset(&communication, 0, sizeof communication);
+
+	//Check session status
+	if (!session_alive(config->session))
+		return COMM_CLOSED;
+
+	//Process incoming requests
+	NC_MSG_TYPE msg_type = nc_session_recv_rpc(config->session, timeout, &communication.msg);
+		//[in]	timeout	Timeout in milliseconds, -1 for infinite timeout, 0 for non-blocking
+	if (config->rpc_received)
+		config->rpc_received(config);
+	if (msg_type == NC_MSG_UNKNOWN) {
+		communication.reply = nc_reply_error(nc_err_new(NC_ERR_MALFORMED_MSG));
+
+		clb_print_error("Broken message recieved");
+		if (!comm_send_reply(config->session, &communication)) {
+			return COMM_CLOSED;
+		}
 
-			//Some interpreter error
-			} else if (!communication.reply) { // Reply could be NULL even if the data store was found
-				//This is for all cases: If lua detect some error enterpreter is better send any status message.
-				communication.reply = nc_reply_error(nc_err_create_from_lua(config->interpreter, NULL));
-			}
+		return COMM_PROCESSED;
+	}
+	if (msg_type != NC_MSG_RPC) {
+		// Nothing complete to read yet (NC_MSG_WOULDBLOCK) or the session got closed meanwhile
+		return session_alive(config->session) ? COMM_IDLE : COMM_CLOSED;
+	}
 
-			//cleanup
-			free(ns);
-			free(rpc_procedure);
-			free(rpc_data);
+	// Limit how long the external commands of this RPC may take
+	commands_set_budget(config->rpc_budget);
 
-			//TODO
-			//Check if libnetconf is testing rpc content
+	//Get more informations about request
+	NC_RPC_TYPE req_type = nc_rpc_get_type(communication.msg);
+	NC_OP req_op = nc_rpc_get_op(communication.msg);
 
-		} else {
-			//Reply to the client's request
-			communication.reply = ncds_apply_rpc2all(config->session, communication.msg, NULL);
+	//Handle session request-class
+	if (req_type == NC_RPC_SESSION) {
+		switch(req_op) {
+		case NC_OP_CLOSESESSION:
+			//Stop loop is OK: session will be physically killed by comm_session_free()
+			closing = true;
+			communication.reply = nc_reply_ok();
+			break;
 
-			if (communication.reply == NULL || communication.reply == NCDS_RPC_NOT_APPLICABLE) {
-				//NC_ERR_UNKNOWN_ELEM sounds good for now
-				communication.reply = nc_reply_error(nc_err_new(NC_ERR_UNKNOWN_ELEM));
-			}
-			bool error = nc_reply_get_type(communication.reply) == NC_REPLY_ERROR;
-			if (error)
-				nlog(NLOG_WARN, "An error message to send: %s\n", nc_reply_get_errormsg(communication.reply));
-			bool finished = false;
-			while (!finished) {
-				bool failed = !interpreter_commit(config->interpreter, !error);
-				if (failed) {
-					nc_reply_free(communication.reply);
-					communication.reply = nc_reply_error(nc_err_create_from_lua(config->interpreter, NULL));
-					if (error)
-						die("Rollback failed (%s), no idea what to do about that", nc_reply_get_errormsg(communication.reply));
-					else {
-						nlog(NLOG_INFO, "Commit failed, doing rollback instead");
-						error = true;
-						assert(communication.reply);
-					}
-				} else
-					finished = true;
-			}
+		default:
+			communication.reply = nc_reply_error(nc_err_new(NC_ERR_OP_NOT_SUPPORTED));
+			break;
+		}
+	} else if (req_type == NC_RPC_UNKNOWN) {
+		//User rpc is expected now
+
+		//libnetconf for all getters says: Caller is responsible for freeing the returned string with free().
+		char *ns = nc_rpc_get_ns(communication.msg);
+
+		communication.reply = NULL;
+
+		const struct datastore *datastore = datastore_lookup(config, ns);
+		bool ds_found = datastore != NULL;
+		if (ds_found) {
+			/*
+			 * We need to do some manual juggling to generate the answer, since
+			 * libnetconf wants to put <data> or <ok> into everything. So build
+			 * the reply document ourselves and let the plugin's answer be put
+			 * right into it, without any intermediate string.
+			 */
+			xmlDocPtr doc = xmlNewDoc(BAD_CAST "1.0");
+			xmlNodePtr root = xmlNewNode(NULL, BAD_CAST "rpc-reply");
+			xmlSetNs(root, xmlNewNs(root, BAD_CAST "urn:ietf:params:xml:ns:netconf:base:1.0", NULL));
+			xmlDocSetRootElement(doc, root);
+			if (interpreter_process_user_rpc(config->interpreter, datastore->lua, communication.msg, root))
+				communication.reply = ncxml_reply_build(doc);
+			xmlFreeDoc(doc);
 		}
 
-		//send reply
-		if (!comm_send_reply(config->session, &communication)) {
-			clb_print_error("Couldn't send reply");
-			break;
+		//Unknown datastore
+		if (!ds_found) {
+			communication.reply = nc_reply_error(nc_err_new(NC_ERR_UNKNOWN_NS));
+
+		//Some interpreter error
+		} else if (!communication.reply) { // Reply could be NULL even if the data store was found
+			//This is for all cases: If lua detect some error enterpreter is better send any status message.
+			communication.reply = nc_reply_error(nc_err_create_from_lua(config->interpreter, NULL));
+		}
+
+		commands_set_budget(0);
+
+		//cleanup
+		free(ns);
+
+		//TODO
+		//Check if libnetconf is testing rpc content
+
+	} else {
+		//Reply to the client's request
+		// Let the data stores know what is asked for, so they can skip the rest
+		if (req_op == NC_OP_GET || req_op == NC_OP_GETCONFIG)
+			config->filter = filter_create(communication.msg);
+		if (req_op == NC_OP_GET)
+			states_prefetch(config);
+		if (filter_is_xpath(config->filter))
+			communication.reply = xpath_get(config, communication.msg, req_op);
+		else if (req_op == NC_OP_GET && !has_filter(communication.msg))
+			communication.reply = full_get(config);
+		else
+			communication.reply = ncds_apply_rpc2all(config->session, communication.msg, NULL);
+		states_drop(config);
+		filter_free(config->filter);
+		config->filter = NULL;
+		// Don't limit the commit, interrupting it in the middle would be worse
+		commands_set_budget(0);
+
+		if (communication.reply == NULL || communication.reply == NCDS_RPC_NOT_APPLICABLE) {
+			//NC_ERR_UNKNOWN_ELEM sounds good for now
+			communication.reply = nc_reply_error(nc_err_new(NC_ERR_UNKNOWN_ELEM));
+		}
+		bool error = nc_reply_get_type(communication.reply) == NC_REPLY_ERROR;
+		if (error)
+			nlog(NLOG_WARN, "An error message to send: %s\n", nc_reply_get_errormsg(communication.reply));
+		bool finished = false;
+		while (!finished) {
+			bool failed = !interpreter_commit(config->interpreter, !error);
+			if (failed) {
+				nc_reply_free(communication.reply);
+				communication.reply = nc_reply_error(nc_err_create_from_lua(config->interpreter, NULL));
+				if (error)
+					die("Rollback failed (%s), no idea what to do about that", nc_reply_get_errormsg(communication.reply));
+				else {
+					nlog(NLOG_INFO, "Commit failed, doing rollback instead");
+					error = true;
+					assert(communication.reply);
+				}
+			} else
+				finished = true;
 		}
 	}
+
+	//send reply
+	if (!comm_send_reply(config->session, &communication)) {
+		clb_print_error("Couldn't send reply");
+		return COMM_CLOSED;
+	}
+
+	return closing ? COMM_CLOSED : COMM_PROCESSED;
 }
 
-void comm_cleanup(struct srv_config *config) {
-	// Cleanup the session structure and free all the allocated resources
-	if (config->session)
-		nc_session_free(config->session);
+enum comm_result comm_process_rpc(struct srv_config *config, struct srv_session *session, int timeout) {
+	// Let the data stores see this session's lock
+	config->session = session->session;
+	config->lock_info = session->lock_info;
+	/*
+	 * The results of the data stores stay on the lua stack until the reply
+	 * is built (sent). Drop them afterwards, or the stack would grow with
+	 * each RPC of each session in the resident server.
+	 */
+	lua_State *lua = interpreter_get_lua(config->interpreter);
+	int top = lua_gettop(lua);
+	enum comm_result result = process_rpc(config, timeout);
+	lua_settop(lua, top);
 	config->session = NULL;
+	config->lock_info = NULL;
+	if (result == COMM_PROCESSED)
+		interpreter_gc_check(config->interpreter);
+	return result;
+}
 
+void comm_start_loop(struct srv_config *config, struct srv_session *session) {
+	while (comm_process_rpc(config, session, -1) != COMM_CLOSED)
+		;
+}
+
+void comm_cleanup(struct srv_config *config) {
 	// Close data stores and free memory for service info around them
 	for (size_t i = 0; i < config->config_datastore_count; i ++) {
 		if (config->config_datastores[i].datastore)
 			ncds_free(config->config_datastores[i].datastore);
 		config->config_datastores[i].datastore = NULL;
-		free(config->config_datastores[i].ns);
 	}
-
-	if (config->lock_info)
-		lock_info_free(config->lock_info);
+	free(config->config_datastores);
+	config->config_datastores = NULL;
+	config->config_datastore_count = 0;
+	free(config->ns_index);
+	config->ns_index = NULL;
 
 	//Close internal libnetconf structures and subsystems
 	nc_close(0);
@@ -27,6 +27,20 @@ struct interpreter;
 struct datastore;
 struct stats_mapping;
 struct nuci_lock_info;
+struct nc_session;
+struct filter;
+
+/*
+ * One client session. Each one has its own lock info, so sessions
+ * served by the same process see each other's locks the same way
+ * separate processes do.
+ */
+struct srv_session {
+	// The session (connection) to the client.
+	struct nc_session *session;
+	// The state of the lock for this session.
+	struct nuci_lock_info *lock_info;
+};
 
 /*
  * Holds server configuration
@@ -34,20 +48,58 @@ struct nuci_lock_info;
 struct srv_config {
 	// The lua interpreter
 	struct interpreter *interpreter;
-	// Lock info (to be freed at the end)
+	/*
+	 * Lock info of the session currently being served. The data stores
+	 * look here, so it is switched for each RPC.
+	 */
 	struct nuci_lock_info *lock_info;
-	// The session (connection) to the client.
+	// The session currently being served.
 	struct nc_session *session;
+	// The filter of the RPC currently being served (NULL if everything is selected)
+	struct filter *filter;
 	// The configuration data store.
 	struct datastore *config_datastores;
 	size_t config_datastore_count;
+	/*
+	 * The data stores indexed by their namespace. It is a hash table with
+	 * open addressing, the size is power of two (mask + 1).
+	 */
+	struct datastore **ns_index;
+	size_t ns_index_mask;
+	// Seconds the external commands of single RPC may take, 0 for no limit
+	int rpc_budget;
+	// Worker threads computing the state of the data stores, NULL if none
+	struct workers *workers;
+	/*
+	 * Called once comm_process_rpc is done reading from the session (whether
+	 * it got an RPC or not), before the RPC is processed. May be NULL.
+	 */
+	void (*rpc_received)(struct srv_config *config);
 };
 
 extern struct srv_config global_srv_config;
 
+// Result of processing a single RPC by comm_process_rpc
+enum comm_result {
+	COMM_PROCESSED, // An RPC was handled and reply sent
+	COMM_IDLE, // Nothing to read for now (only with non-blocking timeout)
+	COMM_CLOSED // The session is terminated or broken
+};
+
 void comm_set_print_error_callback(void(*clb)(const char *message));
+// Initialize libnetconf and the data stores. Does not accept any session.
 bool comm_init(struct srv_config *config_out, struct interpreter *interpreter);
-void comm_start_loop(const struct srv_config *config);
+/*
+ * Accept a new session. If the username is NULL, the session is on stdin and
+ * stdout and the username is the one of the current process, otherwise it
+ * communicates through the given file descriptors. Returns NULL on failure.
+ */
+struct srv_session *comm_session_accept(struct srv_config *config, int input, int output, const char *username);
+// Process one RPC on the session. The timeout is the same as for nc_session_recv_rpc.
+enum comm_result comm_process_rpc(struct srv_config *config, struct srv_session *session, int timeout);
+// Process RPCs on the session until it is closed.
+void comm_start_loop(struct srv_config *config, struct srv_session *session);
+void comm_session_free(struct srv_session *session);
 void comm_cleanup(struct srv_config *config);
 
 #endif // COMMUNICATION_H
@@ -0,0 +1,218 @@
+/*
+ * Copyright 2013, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of NUCI configuration server.
+ *
+ * NUCI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * NUCI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "filter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libnetconf.h>
+#include <libnetconf_xml.h>
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+#include <libxml/xpathInternals.h>
+
+#define NETCONF_NS "urn:ietf:params:xml:ns:netconf:base:1.0"
+
+struct filter {
+	// The copy of the operation, we need to free it at the end
+	xmlNodePtr content;
+	// The <filter/> element inside
+	xmlNodePtr filter;
+	// The xpath expression, if it is the xpath filter
+	xmlChar *select;
+};
+
+static xmlNodePtr first_element(xmlNodePtr node) {
+	while (node && node->type != XML_ELEMENT_NODE)
+		node = node->next;
+	return node;
+}
+
+struct filter *filter_create(const struct nc_msg *rpc) {
+	xmlNodePtr content = ncxml_rpc_get_op_content(rpc);
+	xmlNodePtr operation = first_element(content);
+	xmlNodePtr filter = NULL;
+	if (operation)
+		for (xmlNodePtr child = first_element(operation->children); child; child = first_element(child->next))
+			if (xmlStrcmp(child->name, BAD_CAST "filter") == 0 && child->ns && xmlStrcmp(child->ns->href, BAD_CAST NETCONF_NS) == 0) {
+				filter = child;
+				break;
+			}
+	xmlChar *select = NULL;
+	if (filter) {
+		// Subtree is the default type
+		xmlChar *type = xmlGetNoNsProp(filter, BAD_CAST "type");
+		if (type && xmlStrcmp(type, BAD_CAST "xpath") == 0) {
+			select = xmlGetNoNsProp(filter, BAD_CAST "select");
+			if (!select)
+				filter = NULL; // No expression, so no filter
+		} else if (type && xmlStrcmp(type, BAD_CAST "subtree") != 0) {
+			filter = NULL; // Something we don't understand, don't try to be smart
+		}
+		xmlFree(type);
+	}
+	if (!filter) {
+		xmlFreeNodeList(content);
+		return NULL;
+	}
+	struct filter *result = malloc(sizeof *result);
+	*result = (struct filter) {
+		.content = content,
+		.filter = filter,
+		.select = select
+	};
+	return result;
+}
+
+void filter_free(struct filter *filter) {
+	if (!filter)
+		return;
+	xmlFreeNodeList(filter->content);
+	xmlFree(filter->select);
+	free(filter);
+}
+
+bool filter_selects(const struct filter *filter, const char *ns) {
+	if (!filter || filter->select)
+		return true;
+	for (xmlNodePtr child = first_element(filter->filter->children); child; child = first_element(child->next))
+		// An element without namespace matches in any namespace
+		if (!child->ns || xmlStrcmp(child->ns->href, BAD_CAST ns) == 0)
+			return true;
+	return false;
+}
+
+const struct _xmlNode *filter_subtree(const struct filter *filter, const char *ns) {
+	if (!filter || filter->select)
+		return NULL;
+	xmlNodePtr result = NULL;
+	for (xmlNodePtr child = first_element(filter->filter->children); child; child = first_element(child->next)) {
+		if (!child->ns)
+			return NULL;
+		if (xmlStrcmp(child->ns->href, BAD_CAST ns) == 0) {
+			if (result)
+				return NULL; // Multiple selections, the data store needs to provide them all
+			result = child;
+		}
+	}
+	return result;
+}
+
+bool filter_is_xpath(const struct filter *filter) {
+	return filter && filter->select;
+}
+
+/*
+ * Get the copy of the node in the result. Create it (and its ancestors)
+ * if it is not there yet. The copies are remembered in the _private
+ * field of the original nodes.
+ */
+static xmlNodePtr result_copy(xmlDocPtr result, xmlNodePtr node) {
+	if (node->_private)
+		return node->_private;
+	xmlNodePtr copy = xmlDocCopyNode(node, result, 2); // Without the children
+	if (node->parent && node->parent->type == XML_ELEMENT_NODE)
+		xmlAddChild(result_copy(result, node->parent), copy);
+	else
+		xmlAddChild((xmlNodePtr) result, copy);
+	node->_private = copy;
+	return copy;
+}
+
+/*
+ * Forget the copies of the descendants of the node. Used when the copy of the
+ * node gets replaced by a complete one.
+ */
+static void forget_copies(xmlNodePtr node) {
+	for (xmlNodePtr child = node->children; child; child = child->next) {
+		child->_private = NULL;
+		forget_copies(child);
+	}
+}
+
+static bool is_ancestor(xmlNodePtr ancestor, xmlNodePtr node) {
+	for (; node; node = node->parent)
+		if (node == ancestor)
+			return true;
+	return false;
+}
+
+struct _xmlDoc *filter_xpath_apply(const struct filter *filter, struct _xmlDoc *data, const char **error) {
+	*error = NULL;
+	xmlXPathContextPtr context = xmlXPathNewContext(data);
+	// The namespaces in scope of the filter element are usable in the expression
+	xmlNsPtr *namespaces = xmlGetNsList(filter->filter->doc, filter->filter);
+	for (xmlNsPtr *ns = namespaces; ns && *ns; ns ++)
+		if ((*ns)->prefix)
+			xmlXPathRegisterNs(context, (*ns)->prefix, (*ns)->href);
+	xmlFree(namespaces);
+	xmlXPathObjectPtr selected = xmlXPathEvalExpression(filter->select, context);
+	xmlXPathFreeContext(context);
+	if (!selected) {
+		*error = "Invalid XPath expression in the filter";
+		return NULL;
+	}
+	if (selected->type != XPATH_NODESET) {
+		xmlXPathFreeObject(selected);
+		*error = "The XPath filter must select a node set";
+		return NULL;
+	}
+
+	xmlDocPtr result = xmlNewDoc(BAD_CAST "1.0");
+	xmlNodeSetPtr nodes = selected->nodesetval;
+	if (nodes) {
+		// Go in the document order, so we see the ancestors before their descendants
+		xmlXPathNodeSetSort(nodes);
+		xmlNodePtr last_complete = NULL;
+		for (int i = 0; i < nodes->nodeNr; i ++) {
+			xmlNodePtr node = nodes->nodeTab[i];
+			// Text, attribute and namespace selects the element they belong to
+			if (node->type == XML_NAMESPACE_DECL)
+				// The namespace nodes are xmlNs, the element is stored in next
+				node = (xmlNodePtr) ((xmlNsPtr) node)->next;
+			else if (node->type != XML_ELEMENT_NODE)
+				node = node->parent;
+			if (!node || node->type != XML_ELEMENT_NODE)
+				continue;
+			// Already copied as part of some bigger subtree
+			if (last_complete && is_ancestor(last_complete, node))
+				continue;
+			xmlNodePtr copy = result_copy(result, node);
+			/*
+			 * A text selects its element only after the descendants before
+			 * it, so the copy may already hold some of them. Start over.
+			 */
+			if (copy->children) {
+				while (copy->children) {
+					xmlNodePtr partial = copy->children;
+					xmlUnlinkNode(partial);
+					xmlFreeNode(partial);
+				}
+				forget_copies(node);
+			}
+			// The whole content of the selected node goes in too
+			for (xmlNodePtr child = node->children; child; child = child->next)
+				xmlAddChild(copy, xmlDocCopyNode(child, result, 1));
+			last_complete = node;
+		}
+	}
+	xmlXPathFreeObject(selected);
+	return result;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2013, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of NUCI configuration server.
+ *
+ * NUCI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * NUCI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NUCI_FILTER_H
+#define NUCI_FILTER_H
+
+#include <stdbool.h>
+
+/*
+ * Inspection of the subtree filter of <get/> and <get-config/>, so the
+ * data stores can skip the work nobody asked for. The filter itself is
+ * still applied by libnetconf on the result, so this is only an
+ * optimisation and it is fine to produce more than what is selected.
+ *
+ * The xpath filter is not known to libnetconf, so it is evaluated here.
+ */
+
+struct filter;
+struct nc_msg;
+struct _xmlNode;
+struct _xmlDoc;
+
+/*
+ * Extract the subtree or xpath filter from the rpc. Returns NULL if there's
+ * no filter (or if it is of unknown type), which means everything is
+ * selected.
+ */
+struct filter *filter_create(const struct nc_msg *rpc);
+void filter_free(struct filter *filter);
+
+/*
+ * Can the filter select anything from the given namespace? NULL filter
+ * selects everything, an empty filter nothing. The xpath filter may select
+ * anything.
+ */
+bool filter_selects(const struct filter *filter, const char *ns);
+
+/*
+ * Get the top-level element of the filter for the given namespace. It is
+ * returned only if it is the only thing selecting from the namespace, so
+ * the data store may produce only what is inside. Returns NULL if the
+ * whole namespace should be produced.
+ */
+const struct _xmlNode *filter_subtree(const struct filter *filter, const char *ns);
+
+/*
+ * The libnetconf doesn't know the xpath filter, so we apply it ourselves.
+ * Is it the xpath one?
+ */
+bool filter_is_xpath(const struct filter *filter);
+
+/*
+ * Apply the xpath filter to the data. The top-level elements of the data are
+ * direct children of the document node (there may be multiple of them).
+ * The selected nodes, with their whole content and their ancestors, are
+ * returned in a new document, in the same form.
+ *
+ * The _private fields of the nodes in data are used during the
+ * computation, so the data should be thrown away afterwards.
+ *
+ * In case of error, NULL is returned and error is set to the description.
+ */
+struct _xmlDoc *filter_xpath_apply(const struct filter *filter, struct _xmlDoc *data, const char **error);
+
+#endif
@@ -22,33 +22,44 @@
 #include "model.h"
 #include "logging.h"
 #include "xmlwrap.h"
+#include "shm_cache.h"
+#include "commands.h"
+#include "sysinfo.h"
 
 #include <libnetconf.h>
+#include <libnetconf_xml.h>
 #include <uci.h>
 
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
 #include <sys/types.h>
-#include <sys/select.h>
-#include <sys/wait.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
 
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+// Registry table of the worker interpreters, namespace -> data store
+#define WORKER_DATASTORES "nuci.worker_datastores"
+
+// Number of commits that changed something, shared by all the interpreters
+static unsigned commit_generation;
+
 /**
  * Our own error handler for pcall calls.
  */
 static int lua_handle_runtime_error(lua_State *L) {
-	const char *errmsg = lua_tostring(L, -1);
-
 	//Get stacktrace; in Lua: x = require("stacktraceplus").stacktrace;
 	lua_getfield(L, LUA_GLOBALSINDEX, "require");
 	lua_pushstring(L, "stacktraceplus");
@@ -58,7 +69,7 @@ static int lua_handle_runtime_error(lua_State *L) {
 
 	nlog(NLOG_ERROR, "%s", lua_tostring(L, -1));
 
-	lua_pushstring(L, errmsg); //return
+	lua_pushvalue(L, 1); // Return the original error, it may be a table
 
 	return 1;
 }
@@ -76,207 +87,39 @@ static int register_datastore_provider_lua(lua_State *lua) {
 	int param_count = lua_gettop(lua);
 	if (param_count != 1)
 		luaL_error(lua, "register_datastore_provider expects 1 parameter - the data store, %d given", param_count);
-	int errfunc_index = prepare_errfunc(lua);
 	lua_getfield(lua, 1, "model_file");
 	const char *model_file = lua_tostring(lua, -1);
+	if (!model_file)
+		return luaL_error(lua, "The data store has no model_file");
+	// The model is parsed only once and shared with the C side
+	const struct model *model = model_get(model_file);
+	if (!model)
+		return luaL_error(lua, "Failed to parse the model %s", model_file);
 	// Fill in some values into the provider
-	char *path = model_path(model_file);
-	lua_pushstring(lua, path);
+	lua_pushstring(lua, model->path);
 	lua_setfield(lua, 1, "model_path");
-	char *ns = extract_model_uri_file(path);
-	lua_pushstring(lua, ns);
+	lua_pushstring(lua, model->ns);
 	lua_setfield(lua, 1, "model_ns");
-	char *name = extract_model_name_file(path);
-	lua_pushstring(lua, name);
+	lua_pushstring(lua, model->name);
 	lua_setfield(lua, 1, "model_name");
-	free(path);
-	free(ns);
-	// We fill the model by running the lua XML parser
-	lua_getglobal(lua, "xmlwrap"); // The package
-	lua_getfield(lua, -1, "read_file"); // The function to call
-	lua_getfield(lua, 1, "model_path"); // The file name
-	lua_pcall(lua, 1, 1, errfunc_index);
+	// The document stays owned by the model registry
+	xmlwrap_push_doc(lua, model->doc, false);
 	lua_setfield(lua, 1, "model"); // Copy the result into the datastore
 	// Get the datastore to the top (there's more rumble on top of it by now)
 	lua_pushvalue(lua, 1);
 	lua_datastore datastore = luaL_ref(lua, LUA_REGISTRYINDEX); // Copy the object to the registry
+	// A worker only remembers the data store for itself, the main interpreter registers it
+	lua_getfield(lua, LUA_REGISTRYINDEX, WORKER_DATASTORES);
+	if (lua_istable(lua, -1)) {
+		lua_pushnumber(lua, datastore);
+		lua_setfield(lua, -2, model->ns);
+		return 0;
+	}
 	register_datastore_provider(model_file, datastore);
-	nlog(NLOG_DEBUG, "Registered %s as %d", name, datastore);
+	nlog(NLOG_DEBUG, "Registered %s as %d", model->name, datastore);
 	return 0; // No results
 }
 
-// Check the result is not -1, cause abort and error message if it is
-static void check(int result, const char *operation) {
-	if (result == -1) {
-		die("Error during %s: %s", operation, strerror(errno));
-	}
-}
-
-// Like above, but in child. Don't print with colors.
-static void checkc(int result, const char *operation) {
-	if (result == -1) {
-		fprintf(stderr, "Error during %s: %s", operation, strerror(errno));
-		abort();
-	}
-}
-
-// Helper function to feed data to a pipe
-static bool feed_data(const char *data, size_t *position, size_t len, int pipe) {
-	if (*position == len) {
-		check(close(pipe), "closing stdin");
-		return false;
-	} else {
-		// Write a bit there.
-		ssize_t written = write(pipe, data + *position, len - *position);
-		if (written == -1 && (errno == EACCES || errno == EWOULDBLOCK || errno == EINTR))
-			return true; // These are not errors, retry
-		check(written, "Writing to stdin");
-		*position += written;
-		return true;
-	}
-}
-
-// Set fd nonblocking
-static void unblock(int fd) {
-	int flags = fcntl(fd, F_GETFL, 0);
-	check(flags, "Getting fd flags");
-	check(fcntl(fd, F_SETFL, flags | O_NONBLOCK), "Setting fd non-blocking");
-}
-
-// Update set and maximum for the fd
-static void update_set(int *max_fd, fd_set *set, int fd) {
-	if (fd > *max_fd)
-		*max_fd = fd;
-	FD_SET(fd, set);
-}
-
-static bool read_data(char **buffer, size_t *allocated, size_t *received, int fd) {
-	if (*allocated == *received)
-		*buffer = realloc(*buffer, *allocated *= 2);
-	ssize_t result = read(fd, *buffer + *received, *allocated - *received);
-	if (result == 0) {
-		check(close(fd), "closing pipe");
-		return false;
-	}
-	if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
-		return true; // Retry. These are not really errors.
-	check(result, "reading data");
-	*received += result;
-	return true;
-}
-
-/*
- * Run an external command.
- *
- * First argument is a string to put to the commands stdin. May be
- * nil or empty string.
- *
- * The rest of parameters are the command and its parameters. The first one is taken
- * as the command.
- *
- * Returns (ecode, stdout, stderr). First is number, the other too are strings.
- */
-static int run_command_lua(lua_State *lua) {
-	int param_count = lua_gettop(lua);
-	if (param_count < 2)
-		luaL_error(lua, "run_command expects at least 2 parameters, %d given", param_count);
-
-	// Extract the stdin and command
-	size_t input_len = 0;
-	const char *input = "";
-	if (!lua_isnil(lua, 1))
-		input = lua_tolstring(lua, 1, &input_len);
-	const char *command = lua_tostring(lua, 2);
-
-	// Extract the argv. Param 2 belongs there too.
-	char *argv[param_count]; // One less for stdin, one more for NULL
-	for (int i = 0; i < param_count - 1; i ++) // Lua insists on ints, even if size_t is theoretically more correct
-		argv[i] = strdup(lua_tostring(lua, i + 2));
-	argv[param_count - 1] = NULL;
-
-	// Prepare the pipes
-	int in_pipes[2], out_pipes[2], err_pipes[2];
-	check(pipe(in_pipes), "creating stdin pipe");
-	check(pipe(out_pipes), "creating stdout pipe");
-	check(pipe(err_pipes), "creating stderr pipe");
-
-	// Start the sub process
-	struct timespec orig_time, new_time;
-	clock_gettime(CLOCK_MONOTONIC, &orig_time);
-	pid_t pid = fork();
-	check(pid, "forking run_command");
-	if (pid == 0) {
-		/*
-		 * The child. So, here we close the parental ends of the pipes, and
-		 * install the other ends to stdin, stdout and stderr.
-		 */
-		checkc(close(in_pipes[1]), "closing parent stdin");
-		checkc(close(out_pipes[0]), "closing parent stdout");
-		checkc(close(err_pipes[0]), "closing parent stderr");
-		checkc(dup2(in_pipes[0], 0), "duping stdin");
-		checkc(dup2(out_pipes[1], 1), "duping stdout");
-		checkc(dup2(err_pipes[1], 2), "duping stderr");
-		// The originals are not needed
-		checkc(close(in_pipes[0]), "closing original stdin");
-		checkc(close(out_pipes[1]), "closing original stdout");
-		checkc(close(err_pipes[1]), "closing original stderr");
-		// Run the command
-		checkc(execvp(command, argv), "exec");
-		// We'll never get here. Either exec fails, then check kills us, or we exec.
-	}
-	// OK, we are in the parent now. Close the child ends of pipes.
-	check(close(in_pipes[0]), "closing child stdin");
-	check(close(out_pipes[1]), "closing child stdout");
-	check(close(err_pipes[1]), "closing child stderr");
-	// Set the rest non-blocking
-	unblock(in_pipes[1]);
-	unblock(out_pipes[0]);
-	unblock(err_pipes[0]);
-	// Try to write a bit of stdin, to initialize if we should ask for writability
-	size_t input_position = 0;
-	bool want_write = feed_data(input, &input_position, input_len, in_pipes[1]);
-	bool output_unclosed = true, err_unclosed = true;
-	const size_t base_size = 1024;
-	char *output_data = malloc(base_size), *err_data = malloc(base_size);
-	size_t output_allocated = base_size, err_allocated = base_size,
-	       output_read = 0, err_read = 0;
-	while (output_unclosed || err_unclosed || want_write) {
-		fd_set read_set, write_set;
-		FD_ZERO(&read_set);
-		FD_ZERO(&write_set);
-		int max = 0;
-		if (want_write)
-			update_set(&max, &write_set, in_pipes[1]);
-		if (output_unclosed)
-			update_set(&max, &read_set, out_pipes[0]);
-		if (err_unclosed)
-			update_set(&max, &read_set, err_pipes[0]);
-		int sresult = select(max + 1, &read_set, &write_set, NULL, NULL);
-		if (sresult == -1 && errno == EINTR)
-			continue; // Retry
-		check(sresult, "selecting operation");
-		if (FD_ISSET(in_pipes[1], &write_set))
-			want_write = feed_data(input, &input_position, input_len, in_pipes[1]);
-		if (FD_ISSET(out_pipes[0], &read_set))
-			output_unclosed = read_data(&output_data, &output_allocated, &output_read, out_pipes[0]);
-		if (FD_ISSET(err_pipes[0], &read_set))
-			err_unclosed = read_data(&err_data, &err_allocated, &err_read, err_pipes[0]);
-	}
-	// All three descriptors are closed now.
-	// Get the exit status of the call.
-	int status;
-	check(waitpid(pid, &status, 0), "waiting for sub-process");
-	clock_gettime(CLOCK_MONOTONIC, &new_time);
-	nlog(NLOG_DEBUG, "Command %s took %ld ms", command, (new_time.tv_sec - orig_time.tv_sec) * 1000 + (new_time.tv_nsec - orig_time.tv_nsec) / 1000000);
-	// Output the data.
-	lua_pushnumber(lua, status);
-	lua_pushlstring(lua, output_data, output_read);
-	lua_pushlstring(lua, err_data, err_read);
-	free(output_data);
-	free(err_data);
-	return 3;
-}
-
 static void entity(char *buffer, size_t *pos, const char *name) {
 	buffer[(*pos) ++] = '&';
 	for (const char *c = name; *c; c ++)
@@ -324,13 +167,23 @@ static int xml_escape_lua(lua_State *lua) {
 	return 1;
 }
 
-static int uci_list_configs_lua(lua_State *lua) {
+static struct uci_context *uci_context_create(lua_State *lua) {
 	struct uci_context *ctx = uci_alloc_context();
-	if (!ctx)
-		return luaL_error(lua, "Can't create UCI context");
+	if (!ctx) {
+		luaL_error(lua, "Can't create UCI context");
+		return NULL;
+	}
 	if (getenv("NUCI_TEST_CONFIG_DIR"))
-		if (uci_set_confdir(ctx, getenv("NUCI_TEST_CONFIG_DIR")) != UCI_OK)
-			return luaL_error(lua, "Can't set config dir to %s", getenv("NUCI_TEST_CONFIG_DIR"));
+		if (uci_set_confdir(ctx, getenv("NUCI_TEST_CONFIG_DIR")) != UCI_OK) {
+			uci_free_context(ctx);
+			luaL_error(lua, "Can't set config dir to %s", getenv("NUCI_TEST_CONFIG_DIR"));
+			return NULL;
+		}
+	return ctx;
+}
+
+static int uci_list_configs_lua(lua_State *lua) {
+	struct uci_context *ctx = uci_context_create(lua);
 	char **configs = NULL;
 	if ((uci_list_configs(ctx, &configs) != UCI_OK) || !configs) {
 		uci_free_context(ctx);
@@ -353,6 +206,186 @@ static int uci_list_configs_lua(lua_State *lua) {
 	return 1;
 }
 
+// Output of the uci-raw dump, growing as needed
+struct out_buffer {
+	char *data;
+	size_t len, allocated;
+};
+
+static void out_append(struct out_buffer *out, const char *str, size_t len) {
+	if (out->len + len > out->allocated) {
+		while (out->len + len > out->allocated)
+			out->allocated = out->allocated ? 2 * out->allocated : 4096;
+		out->data = realloc(out->data, out->allocated);
+	}
+	memcpy(out->data + out->len, str, len);
+	out->len += len;
+}
+
+static void out_str(struct out_buffer *out, const char *str) {
+	out_append(out, str, strlen(str));
+}
+
+// The same escaping as xml_escape
+static void out_escaped(struct out_buffer *out, const char *str) {
+	const char *plain = str;
+	for (const char *c = str; *c; c ++) {
+		const char *entity;
+		switch (*c) {
+			case '"':
+				entity = "&quot;";
+				break;
+			case '&':
+				entity = "&amp;";
+				break;
+			case '\'':
+				entity = "&apos;";
+				break;
+			case '<':
+				entity = "&lt;";
+				break;
+			case '>':
+				entity = "&gt;";
+				break;
+			default:
+				continue;
+		}
+		out_append(out, plain, c - plain);
+		out_str(out, entity);
+		plain = c + 1;
+	}
+	out_str(out, plain);
+}
+
+static void out_element(struct out_buffer *out, const char *name, const char *value) {
+	out_append(out, "<", 1);
+	out_str(out, name);
+	out_append(out, ">", 1);
+	out_escaped(out, value);
+	out_str(out, "</");
+	out_str(out, name);
+	out_append(out, ">", 1);
+}
+
+struct indexed_section {
+	struct uci_section *section;
+	size_t index;
+};
+
+// Sort by type, keep the order in the file inside each type
+static int section_cmp(const void *a, const void *b) {
+	const struct indexed_section *sa = a, *sb = b;
+	int result = strcmp(sa->section->type, sb->section->type);
+	if (result)
+		return result;
+	return (sa->index > sb->index) - (sa->index < sb->index);
+}
+
+static void dump_option(struct out_buffer *out, struct uci_option *option) {
+	struct uci_element *e;
+	switch (option->type) {
+		case UCI_TYPE_STRING:
+			out_str(out, "<option>");
+			out_element(out, "name", option->e.name);
+			out_element(out, "value", option->v.string);
+			out_str(out, "</option>");
+			break;
+		case UCI_TYPE_LIST: {
+			out_str(out, "<list>");
+			out_element(out, "name", option->e.name);
+			size_t index = 1;
+			uci_foreach_element(&option->v.list, e) {
+				char index_str[32];
+				snprintf(index_str, sizeof index_str, "%zu", index ++);
+				out_str(out, "<value>");
+				out_element(out, "index", index_str);
+				out_element(out, "content", e->name);
+				out_str(out, "</value>");
+			}
+			out_str(out, "</list>");
+			break;
+		}
+		default:
+			nlog(NLOG_WARN, "Unknown type of UCI option %s", option->e.name);
+			break;
+	}
+}
+
+static void dump_package(struct out_buffer *out, struct uci_package *package) {
+	struct uci_element *e;
+	size_t count = 0;
+	uci_foreach_element(&package->sections, e)
+		count ++;
+	struct indexed_section *sections = malloc(count * sizeof *sections);
+	size_t index = 0;
+	uci_foreach_element(&package->sections, e) {
+		sections[index] = (struct indexed_section) {
+			.section = uci_to_section(e),
+			.index = index
+		};
+		index ++;
+	}
+	qsort(sections, count, sizeof *sections, section_cmp);
+	out_str(out, "<config>");
+	out_element(out, "name", package->e.name);
+	for (size_t i = 0; i < count; i ++) {
+		struct uci_section *section = sections[i].section;
+		out_str(out, "<section>");
+		out_element(out, "name", section->e.name);
+		out_element(out, "type", section->type);
+		if (section->anonymous)
+			out_str(out, "<anonymous/>");
+		struct uci_element *o;
+		uci_foreach_element(&section->options, o)
+			dump_option(out, uci_to_option(o));
+		out_str(out, "</section>");
+	}
+	out_str(out, "</config>");
+	free(sections);
+}
+
+/*
+ * Dump the configs with the given names in the uci-raw format (the <config>
+ * elements, without the <uci> around them). Returns the XML and a table
+ * with errors of configs that failed to load (config -> message).
+ *
+ * It reads the files directly, so it doesn't see changes made through a
+ * lua uci cursor and not yet committed.
+ */
+static int uci_raw_dump_lua(lua_State *lua) {
+	luaL_checktype(lua, 1, LUA_TTABLE);
+	struct uci_context *ctx = uci_context_create(lua);
+	struct out_buffer out = { .data = NULL };
+	lua_newtable(lua);
+	for (int i = 1; ; i ++) {
+		lua_rawgeti(lua, 1, i);
+		const char *config = lua_tostring(lua, -1);
+		if (!config) {
+			lua_pop(lua, 1);
+			break;
+		}
+		struct uci_package *package = NULL;
+		if (uci_load(ctx, config, &package) != UCI_OK || !package) {
+			char *error = NULL;
+			uci_get_errorstr(ctx, &error, NULL);
+			nlog(NLOG_WARN, "Bad config '%s': %s", config, error ? error : "unknown error");
+			lua_pushstring(lua, error ? error : "unknown error");
+			lua_setfield(lua, -3, config);
+			free(error);
+		} else {
+			dump_package(&out, package);
+			// Don't keep all of them in memory at once
+			uci_unload(ctx, package);
+		}
+		lua_pop(lua, 1);
+	}
+	uci_free_context(ctx);
+	lua_pushlstring(lua, out.data ? out.data : "", out.len);
+	free(out.data);
+	lua_insert(lua, -2);
+	return 2;
+}
+
 static int file_executable_lua(lua_State *lua) {
 	// Extract params
 	int param_count = lua_gettop(lua);
@@ -482,11 +515,93 @@ static int file_times_lua(lua_State *lua) {
 	return 3;
 }
 
+/*
+ * read_file(path[, max])
+ *
+ * Read the whole file (or at most max bytes of it) into a string. Returns
+ * nil and error message if it can't be read.
+ *
+ * The buffer is sized by the size of the file, but it is read until the
+ * end anyway, since the files in /proc and /sys claim to have size 0 (or
+ * 4096). It is not mapped, a file truncated while being copied from the
+ * mapping would kill us with SIGBUS.
+ */
+static int read_file_lua(lua_State *lua) {
+	const char *path = luaL_checkstring(lua, 1);
+	lua_Number max_param = luaL_optnumber(lua, 2, -1);
+	size_t max = max_param < 0 ? SIZE_MAX : (size_t) max_param;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		lua_pushnil(lua);
+		lua_pushfstring(lua, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		int error = errno;
+		close(fd);
+		lua_pushnil(lua);
+		lua_pushfstring(lua, "%s: %s", path, strerror(error));
+		return 2;
+	}
+	// Enough for the whole file at once, if it tells the truth about its size
+	size_t allocated = st.st_size > 0 ? (size_t) st.st_size + 1 : 4096;
+	if (allocated > max)
+		allocated = max ? max : 1;
+	char *data = malloc(allocated);
+	size_t len = 0;
+	while (len < max) {
+		if (len == allocated)
+			data = realloc(data, allocated = (allocated * 2 < max ? allocated * 2 : max));
+		ssize_t result = read(fd, data + len, allocated - len);
+		if (result == -1 && errno == EINTR)
+			continue;
+		if (result == -1) {
+			int error = errno;
+			free(data);
+			close(fd);
+			lua_pushnil(lua);
+			lua_pushfstring(lua, "%s: %s", path, strerror(error));
+			return 2;
+		}
+		if (result == 0)
+			break;
+		len += result;
+	}
+	close(fd);
+	lua_pushlstring(lua, data, len);
+	free(data);
+	return 1;
+}
+
 struct interpreter {
 	lua_State *state;
 	bool last_error; // Was there error?
+	int gc_baseline; // Memory in use (kB) after last collection, if the GC is frozen (0 otherwise)
 };
 
+/*
+ * commit_generation()
+ *
+ * Number of commits that actually changed something. Anything computed
+ * from the configuration is outdated once this changes.
+ */
+static int commit_generation_lua(lua_State *lua) {
+	lua_pushnumber(lua, interpreter_commit_generation());
+	return 1;
+}
+
+// commit_generation_bump() -- called when a commit changes the configuration
+static int commit_generation_bump_lua(lua_State *lua) {
+	(void) lua;
+	__atomic_add_fetch(&commit_generation, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+unsigned interpreter_commit_generation(void) {
+	return __atomic_load_n(&commit_generation, __ATOMIC_ACQUIRE);
+}
+
 static void add_func(struct interpreter *interpreter, const char *name, lua_CFunction function) {
 	lua_pushcfunction(interpreter->state, function);
 	lua_setglobal(interpreter->state, name);
@@ -504,14 +619,17 @@ struct interpreter *interpreter_create(void) {
 	};
 	luaL_openlibs(result->state);
 	add_func(result, "register_datastore_provider", register_datastore_provider_lua);
-	add_func(result, "run_command", run_command_lua);
 	add_func(result, "xml_escape", xml_escape_lua);
 	add_func(result, "uci_list_configs", uci_list_configs_lua);
+	add_func(result, "uci_raw_dump", uci_raw_dump_lua);
 	add_func(result, "handle_runtime_error", lua_handle_runtime_error);
 	add_func(result, "file_executable", file_executable_lua);
 	add_func(result, "dir_content", dir_content);
 	add_func(result, "nlog", nlog_lua);
 	add_func(result, "file_times", file_times_lua);
+	add_func(result, "read_file", read_file_lua);
+	add_func(result, "commit_generation", commit_generation_lua);
+	add_func(result, "commit_generation_bump", commit_generation_bump_lua);
 	add_const(result, "NLOG_FATAL", NLOG_FATAL);
 	add_const(result, "NLOG_ERROR", NLOG_ERROR);
 	add_const(result, "NLOG_WARN", NLOG_WARN);
@@ -520,6 +638,9 @@ struct interpreter *interpreter_create(void) {
 	add_const(result, "NLOG_TRACE", NLOG_TRACE);
 
 	xmlwrap_init(result->state);
+	shm_cache_init(result->state);
+	commands_init(result->state);
+	sysinfo_init(result->state);
 
 	// Set the package.path so our own libraries are found. Prepend to the list.
 	lua_getglobal(result->state, "package");
@@ -544,6 +665,22 @@ struct interpreter *interpreter_create(void) {
 	return result;
 }
 
+struct interpreter *interpreter_create_worker(void) {
+	struct interpreter *result = interpreter_create();
+	lua_newtable(result->state);
+	lua_setfield(result->state, LUA_REGISTRYINDEX, WORKER_DATASTORES);
+	return result;
+}
+
+lua_datastore interpreter_worker_datastore(struct interpreter *interpreter, const char *ns) {
+	lua_State *lua = interpreter->state;
+	lua_getfield(lua, LUA_REGISTRYINDEX, WORKER_DATASTORES);
+	lua_getfield(lua, -1, ns);
+	lua_datastore result = lua_isnumber(lua, -1) ? lua_tointeger(lua, -1) : LUA_NOREF;
+	lua_pop(lua, 2);
+	return result;
+}
+
 static bool load_plugin(struct interpreter *interpreter, const char *path, const char *plugin_name) {
 	nlog(NLOG_DEBUG, "Loading plugin %s", plugin_name);
 	size_t path_len = strlen(path);
@@ -612,7 +749,41 @@ lua_State *interpreter_get_lua(struct interpreter *interpreter) {
 	return interpreter->state;
 }
 
-const char *interpreter_get(struct interpreter *interpreter, lua_datastore datastore, const char *method) {
+void interpreter_gc_freeze(struct interpreter *interpreter) {
+	lua_State *lua = interpreter->state;
+	lua_gc(lua, LUA_GCCOLLECT, 0);
+	lua_gc(lua, LUA_GCSTOP, 0);
+	interpreter->gc_baseline = lua_gc(lua, LUA_GCCOUNT, 0);
+	if (!interpreter->gc_baseline)
+		interpreter->gc_baseline = 1; // Keep it marked as frozen
+	nlog(NLOG_DEBUG, "Garbage collector frozen with %d kB in use", interpreter->gc_baseline);
+}
+
+void interpreter_gc_check(struct interpreter *interpreter) {
+	if (!interpreter->gc_baseline)
+		return;
+	lua_State *lua = interpreter->state;
+	int used = lua_gc(lua, LUA_GCCOUNT, 0);
+	/*
+	 * Allow the memory to double before collecting, like the default
+	 * collector pause does. The collection restarts the collector, so
+	 * stop it again.
+	 */
+	if (used > 2 * interpreter->gc_baseline) {
+		nlog(NLOG_DEBUG, "Collecting garbage, %d kB in use", used);
+		lua_gc(lua, LUA_GCCOLLECT, 0);
+		lua_gc(lua, LUA_GCSTOP, 0);
+		interpreter->gc_baseline = lua_gc(lua, LUA_GCCOUNT, 0);
+		if (!interpreter->gc_baseline)
+			interpreter->gc_baseline = 1;
+	}
+}
+
+/*
+ * Call the get or get_config method. If it succeeds, the result is left
+ * on index -2 of the stack.
+ */
+static bool call_get(struct interpreter *interpreter, lua_datastore datastore, const char *method, const xmlNode *filter) {
 	lua_State *lua = interpreter->state;
 	lua_checkstack(lua, LUA_MINSTACK); // Make sure it works even when called multiple times from C
 	//First of all: prepare error function on the stack
@@ -621,26 +792,203 @@ const char *interpreter_get(struct interpreter *interpreter, lua_datastore datas
 	lua_rawgeti(lua, LUA_REGISTRYINDEX, datastore);
 	lua_getfield(lua, -1, method); // The function
 	lua_pushvalue(lua, -2); // The first parameter of a method is the object it is called on
-	// Single parameter - the object.
-	// Two results - the string and error. In case of success, the second is nil.
+	if (filter)
+		xmlwrap_push_node(lua, (xmlNode *) filter);
+	else
+		lua_pushnil(lua);
+	// Two parameters - the object and the filter.
+	// Two results - the string (or document) and error. In case of success, the second is nil.
 	struct timespec orig_time, new_time;
 	clock_gettime(CLOCK_MONOTONIC, &orig_time);
-	if (lua_pcall(lua, 1, 2, errfunc_index) != 0) {
+	if (lua_pcall(lua, 2, 2, errfunc_index) != 0) {
 		flag_error(interpreter, true, -1);
-		return NULL;
+		return false;
 	}
 	clock_gettime(CLOCK_MONOTONIC, &new_time);
 	nlog(NLOG_DEBUG, "Method %s of datastore %d took %ld ms", method, datastore, (new_time.tv_sec - orig_time.tv_sec) * 1000 + (new_time.tv_nsec - orig_time.tv_nsec) / 1000000);
 	// Convert the error only if there's one.
 	if (!lua_isnil(lua, -1)) {
 		flag_error(interpreter, true, -1);
-		return NULL;
+		return false;
 	}
 	flag_error(interpreter, false, 0);
+	return true;
+}
+
+const char *interpreter_get(struct interpreter *interpreter, lua_datastore datastore, const char *method, const xmlNode *filter) {
+	if (!call_get(interpreter, datastore, method, filter))
+		return NULL;
+	lua_State *lua = interpreter->state;
 	if (lua_isnil(lua, -2))
 		return NULL;
-	else
-		return lua_tostring(lua, -2);
+	xmlDoc *doc = xmlwrap_get_doc(lua, -2);
+	if (doc) {
+		// The plugin returned a document, but we need a string.
+		xmlChar *str;
+		int size;
+		xmlDocDumpMemory(doc, &str, &size);
+		lua_pushlstring(lua, (const char *) str, size);
+		xmlFree(str);
+		lua_replace(lua, -3);
+	}
+	return lua_tostring(lua, -2);
+}
+
+/*
+ * Turn the result of get on index -2 of the stack to a document. See
+ * interpreter_get_doc.
+ */
+static xmlDoc *result_doc(struct interpreter *interpreter, const char *method) {
+	lua_State *lua = interpreter->state;
+	if (lua_isnil(lua, -2))
+		return NULL;
+	if (!lua_isstring(lua, -2)) {
+		// Not a string, so it should be a document. Take it directly, no need to serialize it.
+		xmlDoc *doc = xmlwrap_take_doc(lua, -2);
+		if (!doc) {
+			lua_pushfstring(lua, "Method %s returned %s instead of XML", method, luaL_typename(lua, -2));
+			flag_error(interpreter, true, -1);
+		}
+		return doc;
+	}
+	size_t len;
+	const char *result = lua_tolstring(lua, -2, &len);
+	if (!len)
+		return NULL; // Nothing there
+	xmlDoc *doc = xmlReadMemory(result, len, method, NULL, XML_PARSE_NOBLANKS | XML_PARSE_NSCLEAN);
+	if (!doc) {
+		lua_pushfstring(lua, "Method %s returned invalid XML", method);
+		flag_error(interpreter, true, -1);
+	}
+	return doc;
+}
+
+xmlDoc *interpreter_get_doc(struct interpreter *interpreter, lua_datastore datastore, const char *method, const xmlNode *filter) {
+	if (!call_get(interpreter, datastore, method, filter))
+		return NULL;
+	return result_doc(interpreter, method);
+}
+
+// A call of get, running as a coroutine
+struct get_task {
+	lua_State *thread;
+	int thread_ref;
+	struct commands_pending *pending; // The commands it waits for, if any
+	bool done;
+	struct timespec start;
+};
+
+// Collect the result of the get call (or the error), left in the main state
+static void task_result(struct interpreter *interpreter, const char *method, xmlDoc **doc, struct nc_err **error) {
+	if (!lua_isnil(interpreter->state, -1))
+		flag_error(interpreter, true, -1);
+	else {
+		flag_error(interpreter, false, 0);
+		*doc = result_doc(interpreter, method);
+	}
+	if ((*error = nc_err_create_from_lua(interpreter, NULL)) && *doc) {
+		xmlFreeDoc(*doc);
+		*doc = NULL;
+	}
+}
+
+/*
+ * Resume the coroutine of the get call with nargs values from its stack.
+ * If it finishes, the result is stored to doc and error.
+ */
+static void task_resume(struct interpreter *interpreter, struct get_task *task, int nargs, lua_datastore datastore, const char *method, xmlDoc **doc, struct nc_err **error) {
+	lua_State *lua = interpreter->state, *thread = task->thread;
+	int status = lua_resume(thread, nargs);
+	if (status == LUA_YIELD && (task->pending = commands_yielded(thread))) {
+		commands_pending_start(task->pending);
+		return;
+	}
+	task->done = true;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	nlog(NLOG_DEBUG, "Method %s of datastore %d took %ld ms", method, datastore, (end.tv_sec - task->start.tv_sec) * 1000 + (end.tv_nsec - task->start.tv_nsec) / 1000000);
+	if (status == LUA_YIELD) {
+		/*
+		 * It yielded something that isn't ours. We don't know how to
+		 * resume it and running it again could repeat what it did.
+		 */
+		lua_pushfstring(lua, "Method %s of datastore %d yielded outside of run_command", method, datastore);
+		nlog(NLOG_ERROR, "%s", lua_tostring(lua, -1));
+		flag_error(interpreter, true, -1);
+		*error = nc_err_create_from_lua(interpreter, NULL);
+		return;
+	}
+	if (status != 0) {
+		// Same as the error handler of pcall would do, except there's no stack trace
+		lua_xmove(thread, lua, 1);
+		nlog(NLOG_ERROR, "%s", lua_isstring(lua, -1) ? lua_tostring(lua, -1) : "Non-string error");
+		flag_error(interpreter, true, -1);
+		*error = nc_err_create_from_lua(interpreter, NULL);
+		return;
+	}
+	// The string (or document) and the error, as with call_get
+	lua_settop(thread, 2);
+	lua_xmove(thread, lua, 2);
+	task_result(interpreter, method, doc, error);
+}
+
+void interpreter_get_docs(struct interpreter *interpreter, size_t count, const lua_datastore *datastores, const char *method, const xmlNode *const *filters, xmlDoc **docs, struct nc_err **errors) {
+	if (!count)
+		return;
+	lua_State *lua = interpreter->state;
+	lua_checkstack(lua, LUA_MINSTACK);
+	int top = lua_gettop(lua);
+	struct get_task tasks[count];
+	for (size_t i = 0; i < count; i ++) {
+		docs[i] = NULL;
+		errors[i] = NULL;
+		lua_State *thread = lua_newthread(lua);
+		tasks[i] = (struct get_task) {
+			.thread = thread,
+			.thread_ref = luaL_ref(lua, LUA_REGISTRYINDEX)
+		};
+		commands_mark_async(thread);
+		// The method, the data store and the filter, as in call_get
+		lua_rawgeti(thread, LUA_REGISTRYINDEX, datastores[i]);
+		lua_getfield(thread, -1, method);
+		lua_insert(thread, -2);
+		if (filters[i])
+			xmlwrap_push_node(thread, (xmlNode *) filters[i]);
+		else
+			lua_pushnil(thread);
+		clock_gettime(CLOCK_MONOTONIC, &tasks[i].start);
+		task_resume(interpreter, &tasks[i], 2, datastores[i], method, &docs[i], &errors[i]);
+	}
+	for (;;) {
+		// Resume the ones with finished commands
+		for (size_t i = 0; i < count; i ++) {
+			struct get_task *task = &tasks[i];
+			if (task->done || !commands_pending_done(task->pending))
+				continue;
+			int results = commands_pending_push(task->thread, task->pending);
+			task->pending = NULL;
+			if (results == -1) {
+				task->done = true;
+				commands_push_budget_error(lua);
+				flag_error(interpreter, true, -1);
+				errors[i] = nc_err_create_from_lua(interpreter, NULL);
+			} else {
+				task_resume(interpreter, task, results, datastores[i], method, &docs[i], &errors[i]);
+			}
+		}
+		// Wait for the commands of all the others together
+		struct commands_pending *pendings[count];
+		size_t waiting = 0;
+		for (size_t i = 0; i < count; i ++)
+			if (!tasks[i].done)
+				pendings[waiting ++] = tasks[i].pending;
+		if (!waiting)
+			break;
+		commands_pending_poll(pendings, waiting);
+	}
+	for (size_t i = 0; i < count; i ++)
+		luaL_unref(lua, LUA_REGISTRYINDEX, tasks[i].thread_ref);
+	lua_settop(lua, top);
 }
 
 void interpreter_set_config(struct interpreter *interpreter, lua_datastore datastore, const char *config, const char *default_op, const char *error_opt) {
@@ -670,7 +1018,79 @@ void flag_error(struct interpreter *interpreter, bool error, int err_index) {
 	}
 }
 
-char *interpreter_process_user_rpc(struct interpreter *interpreter, lua_datastore ds, char *procedure, char *data) {
+/*
+ * Put the content of the RPC into a new document, so it can be passed to lua.
+ * The libnetconf gives us a copy of the already parsed nodes, so there's no
+ * need to serialize and parse it again.
+ */
+static xmlDoc *rpc_content_doc(const nc_rpc *rpc) {
+	xmlDoc *doc = xmlNewDoc(BAD_CAST "1.0");
+	xmlNode *content = ncxml_rpc_get_op_content(rpc);
+	while (content) {
+		xmlNode *node = content;
+		content = content->next;
+		xmlUnlinkNode(node);
+		// Only single element may be in the document
+		if (node->type == XML_ELEMENT_NODE && !xmlDocGetRootElement(doc))
+			xmlDocSetRootElement(doc, node);
+		else
+			xmlFreeNode(node);
+	}
+	return doc;
+}
+
+/*
+ * Put the result of user RPC (on index -2) into the reply. The result may
+ * be either a document, whose nodes are moved directly, or a string, which is
+ * parsed right into the place.
+ */
+static bool add_user_rpc_result(lua_State *lua, xmlNode *reply) {
+	if (lua_isnil(lua, -2))
+		return true;
+	if (!lua_isstring(lua, -2)) {
+		xmlDoc *doc = xmlwrap_take_doc(lua, -2);
+		if (!doc)
+			return false;
+		xmlNode *node = doc->children;
+		while (node) {
+			xmlNode *next = node->next;
+			if (node->type == XML_ELEMENT_NODE) {
+				xmlUnlinkNode(node);
+				xmlDOMWrapAdoptNode(NULL, doc, node, reply->doc, reply, 0);
+				xmlAddChild(reply, node);
+			}
+			node = next;
+		}
+		xmlFreeDoc(doc);
+		return true;
+	}
+	size_t len;
+	const char *data = lua_tolstring(lua, -2, &len);
+	// The XML declaration can't be inside other element
+	if (strncmp("<?xml ", data, 6) == 0) {
+		const char *end = strstr(data, "?>");
+		if (!end)
+			return false;
+		len -= end + 2 - data;
+		data = end + 2;
+	}
+	// Skip the whitespace, empty result is OK
+	while (len && strchr(" \t\r\n", *data)) {
+		data ++;
+		len --;
+	}
+	if (!len)
+		return true;
+	xmlNode *nodes = NULL;
+	if (xmlParseInNodeContext(reply, data, len, XML_PARSE_NOBLANKS | XML_PARSE_NSCLEAN, &nodes) != XML_ERR_OK) {
+		xmlFreeNodeList(nodes);
+		return false;
+	}
+	xmlAddChildList(reply, nodes);
+	return true;
+}
+
+bool interpreter_process_user_rpc(struct interpreter *interpreter, lua_datastore ds, const struct nc_msg *rpc, struct _xmlNode *reply) {
 	lua_State *lua = interpreter->state;
 	lua_checkstack(lua, LUA_MINSTACK);
 
@@ -678,8 +1098,20 @@ char *interpreter_process_user_rpc(struct interpreter *interpreter, lua_datastor
 	lua_rawgeti(lua, LUA_REGISTRYINDEX, ds);
 	lua_getfield(lua, -1, "user_rpc");
 	lua_pushvalue(lua, -2);
+	char *procedure = nc_rpc_get_op_name(rpc);
 	lua_pushstring(lua, procedure);
-	lua_pushstring(lua, data);
+	free(procedure);
+	// Does the data store want the parsed document, or the string?
+	lua_getfield(lua, -2, "user_rpc_parsed");
+	bool parsed = lua_toboolean(lua, -1);
+	lua_pop(lua, 1);
+	if (parsed) {
+		xmlwrap_push_doc(lua, rpc_content_doc(rpc), true);
+	} else {
+		char *data = nc_rpc_get_op_content(rpc);
+		lua_pushstring(lua, data);
+		free(data);
+	}
 
 	/**
 	 * 1st return parameter is string with reply
@@ -689,13 +1121,18 @@ char *interpreter_process_user_rpc(struct interpreter *interpreter, lua_datastor
 
 	if (status != 0) { //Runtime error and error message is on the top of stack
 		flag_error(interpreter, true, -1); //only one result, i.e. on the top
-		return NULL;
+		return false;
 	} else if (status == 0 && !lua_isnil(lua, -1)) {
 		flag_error(interpreter, true, -1);
-		return NULL;
+		return false;
 	} else { //all is OK an I have result
-		const char *str = lua_tostring(lua, -2);
-		return strdup(str ? str : "");
+		if (!add_user_rpc_result(lua, reply)) {
+			lua_pushstring(lua, "Invalid XML returned from user RPC");
+			flag_error(interpreter, true, -1);
+			return false;
+		}
+		flag_error(interpreter, false, 0);
+		return true;
 	}
 }
 
@@ -21,6 +21,7 @@
 #define INTERPRETER_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <lua.h>
 
 /*
@@ -32,11 +33,31 @@ struct interpreter;
 
 // Create a lua interpreter and load the standard libraries
 struct interpreter *interpreter_create(void);
+/*
+ * Create an interpreter for a worker thread (see workers.h). The data stores
+ * loaded into it are not registered for the libnetconf, they can be only
+ * looked up by interpreter_worker_datastore.
+ */
+struct interpreter *interpreter_create_worker(void);
 // Destroy the lua interpreter
 void interpreter_destroy(struct interpreter *interpreter);
 
 lua_State *interpreter_get_lua(struct interpreter *interpreter);
 
+/*
+ * Prepare the interpreter to be shared by forked processes. It collects
+ * all the garbage and stops the automatic garbage collector, since a
+ * collection cycle touches all the objects and that would unshare the
+ * memory pages.
+ */
+void interpreter_gc_freeze(struct interpreter *interpreter);
+/*
+ * If the garbage collector is frozen, run a collection if the memory grew
+ * too much since the last one (and keep it frozen). Does nothing otherwise.
+ * Meant to be called between requests.
+ */
+void interpreter_gc_check(struct interpreter *interpreter);
+
 /*
  * Scan given directory and load and run all *.lua files there on given interpreter.
  *
@@ -52,15 +73,53 @@ bool interpreter_load_plugins(struct interpreter *interpreter, const char *path)
  */
 typedef int lua_datastore;
 
+// The data store of the worker interpreter with the namespace, LUA_NOREF if none.
+lua_datastore interpreter_worker_datastore(struct interpreter *interpreter, const char *ns);
+
+/*
+ * Number of commits that changed the configuration so far (in any of the
+ * interpreters). Accessible from lua as commit_generation().
+ */
+unsigned interpreter_commit_generation(void);
+
+struct _xmlDoc;
+struct _xmlNode;
+
 /*
  * Call the get_config method of the data store. The result is owned by lua and may
  * disappear any time more lua is called.
  *
  * This is meant for the methods get and get_config, which have the same interface.
+ * They may return either a string or an xmlwrap document (which is serialized then).
+ *
+ * The filter is the part of the subtree filter for this data store (see filter_subtree),
+ * passed to the method as a hint. It may be NULL.
  *
  * In case of error, NULL is returned and the error is flagged.
  */
-const char *interpreter_get(struct interpreter *interpreter, lua_datastore datastore, const char *method);
+const char *interpreter_get(struct interpreter *interpreter, lua_datastore datastore, const char *method, const struct _xmlNode *filter);
+
+/*
+ * Similar to interpreter_get, but return the result as a document. If the
+ * method returns an xmlwrap document, it is taken over directly, without
+ * serializing and parsing it. Ownership of the result is passed to the caller.
+ *
+ * If there's no data (nil or empty string), NULL is returned and no error is
+ * flagged. In case of error, NULL is returned and the error is flagged.
+ */
+struct _xmlDoc *interpreter_get_doc(struct interpreter *interpreter, lua_datastore datastore, const char *method, const struct _xmlNode *filter);
+
+struct nc_err;
+/*
+ * Call the method of several data stores, like interpreter_get_doc. Each
+ * call runs in its own coroutine, and the external commands they run wait
+ * in one common loop, so the data stores don't wait for each other's
+ * commands.
+ *
+ * The results are stored into docs, the errors into errors (NULL if there's
+ * none), both in the order of the datastores.
+ */
+void interpreter_get_docs(struct interpreter *interpreter, size_t count, const lua_datastore *datastores, const char *method, const struct _xmlNode *const *filters, struct _xmlDoc **docs, struct nc_err **errors);
 
 /*
  * Call the set_config method of the data store, possibly storing the data there.
@@ -69,7 +128,16 @@ const char *interpreter_get(struct interpreter *interpreter, lua_datastore datas
  */
 void interpreter_set_config(struct interpreter *interpreter, lua_datastore datastore, const char *config, const char *default_op, const char *error_opt);
 
-char *interpreter_process_user_rpc(struct interpreter *interpreter, lua_datastore ds, char *procedure, char *data);
+struct nc_msg;
+/*
+ * Call the user_rpc method of the data store, with the name of the RPC and
+ * its content. The content is passed as an xmlwrap document if the data store
+ * has the user_rpc_parsed flag set, as a string otherwise.
+ *
+ * The result (either string or xmlwrap document) is put as the content of
+ * the reply node. Returns false in case of error (which is flagged).
+ */
+bool interpreter_process_user_rpc(struct interpreter *interpreter, lua_datastore ds, const struct nc_msg *rpc, struct _xmlNode *reply);
 
 
 // Error handling
@@ -25,6 +25,11 @@ function commit_mark_dirty(uci_name)
 	uci_dirty[uci_name] = true;
 end
 
+-- Are there changes to the config in the uci cursor, not yet committed?
+function commit_is_dirty(uci_name)
+	return uci_dirty[uci_name] or false;
+end
+
 --[[
 Schedule a function to be called as part of the success
 commit chain. Higher priority sooner. The commit chain
@@ -59,6 +64,11 @@ local function store_uci()
 	for config in pairs(uci_dirty) do
 		cursor:commit(config);
 	end
+	if next(uci_dirty) then
+		commit_generation_bump();
+		-- The other processes need to know too
+		shm_cache_invalidate();
+	end
 end
 
 -- TODO: Function to set up these from plugins
@@ -18,6 +18,7 @@ along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
 ]]
 
 require("editconfig")
+require("commits")
 --[[
 Create a skeleton data store.
 ]]
@@ -44,6 +45,86 @@ function datastore(model_file)
 		return "";
 	end
 	--[[
+	The core calls this instead of get(). If the data store sets the
+	cache_policy field, the result of get() without a filter is kept
+	and returned again while it is fresh. The policy is a table with:
+	- ttl -- number of seconds the result is valid.
+	- commit -- if true, the result is dropped whenever a commit
+	  changes the configuration.
+	- shared -- if set, the result (filtered ones too) is also stored
+	  in the cache shared by all the nuci processes and the fresh
+	  results computed by other sessions are used. The value is the
+	  number of seconds such result is valid. Any commit that changes
+	  the configuration drops the whole shared cache.
+
+	The hit and miss counters are in the cache_stats field.
+	]]
+	result.cache_stats = { hits = 0, shared_hits = 0, misses = 0 };
+	function result:get_cached(filter)
+		local policy = self.cache_policy;
+		-- Filtered results differ, caching them locally is not worth it
+		if not policy or (filter and not policy.shared) then
+			return self:get(filter);
+		end
+		local stats = self.cache_stats;
+		local now = os.time();
+		local cache = not filter and self.cache;
+		local fresh = cache and (not policy.ttl or (now >= cache.time and now - cache.time < policy.ttl)) and (not policy.commit or cache.generation == commit_generation());
+		if fresh then
+			stats.hits = stats.hits + 1;
+			nlog(NLOG_DEBUG, "Cache hit on ", self.model_name, " (", stats.hits, " hits, ", stats.shared_hits, " shared hits, ", stats.misses, " misses)");
+			return cache.value;
+		end
+		if policy.shared then
+			local value = shm_cache_get(self.model_ns, filter, policy.shared);
+			if value then
+				stats.shared_hits = stats.shared_hits + 1;
+				nlog(NLOG_DEBUG, "Shared cache hit on ", self.model_name, " (", stats.hits, " hits, ", stats.shared_hits, " shared hits, ", stats.misses, " misses)");
+				return value;
+			end
+		end
+		stats.misses = stats.misses + 1;
+		nlog(NLOG_DEBUG, "Cache miss on ", self.model_name, " (", stats.hits, " hits, ", stats.shared_hits, " shared hits, ", stats.misses, " misses)");
+		-- Take the generations before the get, a commit during it makes the value outdated
+		local generation = commit_generation();
+		local shared_generation = policy.shared and shm_cache_generation();
+		local value, err = self:get(filter);
+		if err then
+			return value, err;
+		end
+		-- The document is taken away by the core, keep it serialized
+		local stored = value;
+		if type(value) ~= 'string' and value ~= nil then
+			stored = value:strdump();
+		end
+		if not filter then
+			self.cache = {
+				value = stored,
+				time = now,
+				generation = generation
+			};
+		end
+		if policy.shared and stored then
+			shm_cache_put(self.model_ns, filter, stored, shared_generation);
+		end
+		return value;
+	end
+	--[[
+	Drop the cached result of get(), for example after an RPC that
+	changed the state.
+	]]
+	function result:cache_invalidate()
+		self.cache = nil;
+		if self.cache_policy and self.cache_policy.commit then
+			-- The copies of the data store in the worker threads have caches of their own
+			commit_generation_bump();
+		end
+		if self.cache_policy and self.cache_policy.shared then
+			-- There's no way to drop just our part of it
+			shm_cache_invalidate();
+		end
+	end
+	--[[
 	Error reporting from user_rpcs:
 	OK, no error, some data: return data, nil;
 	FAILED with "error message" error: return nil, "error message";
@@ -52,12 +133,20 @@ function datastore(model_file)
 		return nil, "Custom RPCs are not implemented yet";
 	end
 	--[[
+	The current config to run the edit-config against. The operation
+	is the parsed command. A data store may return only the part of
+	the config the command touches, if it is cheaper to get.
+	]]
+	function result:edit_config_current(operation, defop)
+		return self:get_config();
+	end
+	--[[
 	Helper function. Wrapper around the global editconfig, to get the
 	corresponding operations on the config.
 	]]
 	function result:edit_config_ops(config, defop, deferr)
-		local current = xmlwrap.read_memory('<config>' .. strip_xml_def(self:get_config()) .. '</config>');
 		local operation = xmlwrap.read_memory('<edit>' .. strip_xml_def(config) .. '</edit>');
+		local current = xmlwrap.read_memory('<config>' .. strip_xml_def(self:edit_config_current(operation, defop)) .. '</config>');
 		local ops, err = editconfig(current, operation, self.model, self.model_ns, defop, deferr);
 		return ops, err, current, operation;
 	end
@@ -100,9 +189,14 @@ function datastore(model_file)
 	--[[
 	Upon the registration, the core sets these:
 	- model_path -- full path to the model file.
-	- model -- parsed xmlwrap object of the model.
+	- model -- parsed xmlwrap object of the model. It is shared with the core,
+	  so it must not be modified.
 	- model_ns -- namespace of the model.
 	- model_name -- The name of the model.
+
+	The data store may set these itself:
+	- user_rpc_parsed -- if true, user_rpc gets the content of the RPC
+	  as parsed xmlwrap document instead of a string.
 	]]
 	return result;
 end
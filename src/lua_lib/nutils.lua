@@ -25,6 +25,17 @@ local yang_ns = 'urn:ietf:params:xml:ns:yang:yin:1'
 debug.traceback = require("stacktraceplus").stacktrace;
 -- And now just call: print(debug.traceback());
 
+--[[
+Raise the error again if it is the one of the exceeded time budget of the
+RPC. Call it with the error caught by pcall around code running commands,
+so the budget error is not turned into some other one.
+]]
+function budget_rethrow(err)
+	if err == budget_exceeded then
+		error(err, 0);
+	end
+end
+
 -- Find the first child node matching a predicate, or nil.
 function find_node(node, predicate)
 	for child in node:iterate() do
@@ -41,6 +52,14 @@ end
 
 -- Find a subnode with given name and ns
 function find_node_name_ns(node, name, ns)
+	if name:match('^[%a_][%w_%-%.]*$') then
+		-- Let libxml2 do the search, with a compiled (and cached) expression
+		if ns then
+			return node:xpath('n:' .. name, { n = ns })[1];
+		else
+			return node:xpath(name)[1];
+		end
+	end
 	return find_node(node, function(node)
 		local nname, nns = node:name();
 		return ns == nns and name == nname;
@@ -201,14 +220,7 @@ end
 
 -- Get content of a file or nil, error
 function file_content(path)
-	local file, err = io.open(path, "r");
-	if file then
-		local data = file:read("*a");
-		file:close();
-		return data;
-	else
-		return nil, err
-	end
+	return read_file(path);
 end
 
 -- return the directory name of the file
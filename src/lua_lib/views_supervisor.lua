@@ -428,7 +428,7 @@ function supervisor:generate_datasource_provider(yin_name)
 		local doc, err = supervisor:get(self.model_name, self.model_ns);
 
 		if doc then
-			return doc:strdump();
+			return doc;
 		else
 			return nil, err;
 		end
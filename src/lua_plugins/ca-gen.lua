@@ -22,6 +22,9 @@ require("nutils");
 require("cert");
 
 local datastore = datastore("ca-gen.yin");
+-- The generation may run in the background, so don't keep the result for long
+datastore.cache_policy = { ttl = 5, commit = true };
+datastore.user_rpc_parsed = true;
 local ca_dir = '/etc/ssl/ca'
 local script_dir = '/usr/share/nuci/ca/';
 local script = script_dir .. 'gen';
@@ -153,7 +156,7 @@ function datastore:get()
 		end
 	end
 
-	return xml:strdump();
+	return xml;
 end
 
 local function notes_parse(path, name)
@@ -336,7 +339,9 @@ function datastore:revoke_params(ca)
 end
 
 function datastore:user_rpc(rpc, data)
-	local xml = xmlwrap.read_memory(data);
+	-- Most of the RPCs change the CAs
+	self:cache_invalidate();
+	local xml = data;
 	local root = xml:root();
 	if rpc == 'download' then
 		-- Unfortunately, we return part of XML and this one wouldn't have single root, so we build each one separately and concatenate as strings. We are supposted to return string anyway.
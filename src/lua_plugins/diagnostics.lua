@@ -21,6 +21,7 @@ require("datastore");
 require("nutils");
 
 local datastore = datastore("diagnostics.yin");
+datastore.user_rpc_parsed = true;
 
 local binary_path = "/usr/share/diagnostics/diagnostics.sh";
 
@@ -40,7 +41,7 @@ function get_diag_id(root, ns)
 end
 
 function datastore:user_rpc(rpc, data)
-	local xml = xmlwrap.read_memory(data);
+	local xml = data;
 	local root = xml:root();
 
 	if rpc == 'prepare' then
@@ -20,6 +20,8 @@ along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
 require("datastore");
 
 local datastore = datastore("firewall.yin");
+datastore.user_rpc_parsed = true;
+datastore.cache_policy = { ttl = 10, commit = true };
 
 local dir = "/var/log/turris-pcap";
 local description = "/tmp/rule-description.txt";
@@ -41,7 +43,9 @@ function is_pcap(fileinfo)
 end
 
 function datastore:user_rpc(rpc, data)
-	local xml = xmlwrap.read_memory(data);
+	-- The RPCs delete the files we list
+	self:cache_invalidate();
+	local xml = data;
 	local root = xml:root();
 
 	if rpc == 'pcap-delete' then
@@ -125,9 +129,10 @@ end
 function datastore:get()
 	local rules = {};
 	local current_rule;
-	local desc, err = io.open(description);
+	local desc, err = read_file(description);
 	if desc then
-		for line in desc:lines() do
+		-- The extra newline makes sure the last line is not lost, empty lines are skipped anyway
+		for line in lines(desc .. '\n') do
 			local empty_match = line:match("^%s*");
 			local name_match = line:match("^(%w+)%s*");
 			local desc_match = line:match("^%s+(.-)%s*$");
@@ -197,7 +202,7 @@ function datastore:get()
 			f:add_child('size'):set_text(file.size);
 		end
 	end
-	return xml:strdump();
+	return xml;
 end
 
 register_datastore_provider(datastore);
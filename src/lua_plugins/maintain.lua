@@ -21,9 +21,10 @@ require("datastore");
 require("nutils");
 
 local datastore = datastore("maintain.yin");
+datastore.user_rpc_parsed = true;
 
 function datastore:user_rpc(rpc, data)
-	local xml = xmlwrap.read_memory(data);
+	local xml = data;
 	local root = xml:root();
 
 	if rpc == 'reboot' then
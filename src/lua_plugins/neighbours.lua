@@ -22,6 +22,8 @@ require("datastore");
 require("nutils");
 
 local datastore = datastore("neighbours.yin");
+-- Computing the neighbours runs several commands, don't do it on every get
+datastore.cache_policy = { ttl = 5, shared = 5 };
 
 local function parse_dhcp_lease_line(line)
 	-- put items into a table
@@ -124,14 +126,11 @@ function datastore:get()
 	local root = doc:root();
 
 
-	-- Parse ip neighbour command
-	local ret, out, err = run_command(nil, 'ip', '-s', 'neighbour');
-	if ret ~= 0 then
-		return nil, "Failed to trigger 'ip neighbour' command.";
-	end
+	-- Parse ip neighbour command, as the output comes (there may be a lot of neighbours)
+	local neighbours, proc = run_command_lines(nil, 'ip', '-s', 'neighbour');
 	local res = {};
-	if not pcall(function ()
-			for line in lines(out) do
+	local ok, err = pcall(function ()
+			for line in neighbours do
 				local data = parse_ip_neighbours_line(line);
 				-- insert only if the record has a mac address
 				if data.mac then
@@ -150,9 +149,15 @@ function datastore:get()
 					end
 				end
 			end
-		end) then
+		end);
+	if not ok then
+		budget_rethrow(err);
+		proc:finish();
 		return nil, "Failed to parse 'ip neighbour' command.";
 	end
+	if proc:finish() ~= 0 then
+		return nil, "Failed to trigger 'ip neighbour' command.";
+	end
 
 	-- read lease file from uci
 	local dhcp_lease_paths = read_dhcp_lease_paths();
@@ -229,42 +234,43 @@ function datastore:get()
 		return nil, "Failed to read conntrack file: " .. err_msg;
 	end
 
-	-- Create xml
+	-- Create xml, each neighbour in one add_tree call
 	for mac, data in pairs(res) do
 		for dev, record in pairs(data) do
-			local neighbour = root:add_child('neighbour');
-			neighbour:add_child('mac-address'):set_text(mac);
-			if dev then
-				neighbour:add_child('interface'):set_text(dev);
-			else
-				neighbour:add_child('interface'):set_text('unknown');
-			end
+			local children = {
+				{ name = 'mac-address', text = mac },
+				{ name = 'interface', text = dev or 'unknown' }
+			};
 			for ip, ip_record in pairs(record) do
-				local ip_dom = neighbour:add_child('ip-address');
-				ip_dom:add_child('ip'):set_text(ip);
-				ip_dom:add_child('connection-count'):set_text(ip_counts[ip] or "0");
+				local ip_children = {
+					{ name = 'ip', text = ip },
+					{ name = 'connection-count', text = ip_counts[ip] or "0" }
+				};
 				for _, key in pairs({'nud', 'dhcp-lease', 'hostname', 'router'}) do
 					if ip_record[key] then
 						if key == 'router' then
-							ip_dom:add_child('router');
+							table.insert(ip_children, { name = 'router' });
 						elseif key == 'hostname' and ip_record.hostname == "*" then
 							-- don't append * hostname
 						else
-							ip_dom:add_child(key):set_text(ip_record[key]);
+							table.insert(ip_children, { name = key, text = ip_record[key] });
 						end
 					end
 				end
 				if ip_record.statistics then
-					local stat_dom = ip_dom:add_child('statistics');
-					stat_dom:add_child('used'):set_text(ip_record.statistics.used);
-					stat_dom:add_child('confirmed'):set_text(ip_record.statistics.confirmed);
-					stat_dom:add_child('updated'):set_text(ip_record.statistics.updated);
+					table.insert(ip_children, { name = 'statistics', children = {
+						{ name = 'used', text = ip_record.statistics.used },
+						{ name = 'confirmed', text = ip_record.statistics.confirmed },
+						{ name = 'updated', text = ip_record.statistics.updated }
+					} });
 				end
+				table.insert(children, { name = 'ip-address', children = ip_children });
 			end
+			root:add_tree({ name = 'neighbour', children = children });
 		end
 	end
 
-	return doc:strdump();
+	return doc;
 end
 
 
@@ -39,51 +39,64 @@ local function parse_line(line)
 	return items;
 end
 
-local function parse_file(file, node)
+local function leaf(name, text)
+	return { name = name, text = text };
+end
+
+-- Parse the history into a table for xmlwrap's add_tree
+local function parse_file(content)
 	local prev_time = -1; -- 0 is possible value; not 1. 1. 1970 but unsnapped slot
 	local prev_item = nil;
 
-	local snap_node;
-	local net_node;
-	for line in file:lines() do
+	local snapshots = {};
+	local snap_children;
+	local net_children;
+	for line in lines(content) do
 		items = parse_line(line);
 		if items[1] ~= '0' then
 			if prev_time ~= items[1] then
-				snap_node = node:add_child('snapshot');
-				snap_node:add_child('time'):set_text(items[1]);
+				snap_children = { leaf('time', items[1]) };
+				table.insert(snapshots, { name = 'snapshot', children = snap_children });
 				prev_item = nil;
 			end
 
 			if items[2] == "cpu" then
-				snap_node:add_child('cpu'):add_child('load'):set_text(items[3]);
+				table.insert(snap_children, { name = 'cpu', children = { leaf('load', items[3]) } });
 			elseif items[2] == "memory" then
-				local mem_node = snap_node:add_child('memory');
-				mem_node:add_child('memtotal'):set_text(items[3]);
-				mem_node:add_child('memfree'):set_text(items[4]);
-				mem_node:add_child('buffers'):set_text(items[5]);
-				mem_node:add_child('cached'):set_text(items[6]);
+				table.insert(snap_children, { name = 'memory', children = {
+					leaf('memtotal', items[3]),
+					leaf('memfree', items[4]),
+					leaf('buffers', items[5]),
+					leaf('cached', items[6])
+				} });
 			elseif items[2] == "network" then
 				if prev_item ~= items[2] then
-					net_node = snap_node:add_child('network');
+					net_children = {};
+					table.insert(snap_children, { name = 'network', children = net_children });
 				end
-				local iface_node = net_node:add_child('interface');
-				iface_node:add_child('name'):set_text(items[3]);
-				iface_node:add_child('rx'):set_text(items[4]);
-				iface_node:add_child('tx'):set_text(items[5]);
+				table.insert(net_children, { name = 'interface', children = {
+					leaf('name', items[3]),
+					leaf('rx', items[4]),
+					leaf('tx', items[5])
+				} });
 			elseif items[2] == "temperature" then
-				local temp_node = snap_node:add_child('temperature');
-				temp_node:add_child('board'):set_text(items[3]);
-				temp_node:add_child('cpu'):set_text(items[4]);
+				table.insert(snap_children, { name = 'temperature', children = {
+					leaf('board', items[3]),
+					leaf('cpu', items[4])
+				} });
 			elseif items[2] == "fs" then
-				local temp_node = snap_node:add_child('rootfs');
-				temp_node:add_child('used'):set_text(items[3]);
-				temp_node:add_child('available'):set_text(items[4]);
+				table.insert(snap_children, { name = 'rootfs', children = {
+					leaf('used', items[3]),
+					leaf('available', items[4])
+				} });
 			end
 			prev_item = items[2];
 		end
 
 		prev_time = items[1];
 	end
+
+	return { name = 'snapshots', children = snapshots };
 end
 
 local datastore = datastore('nethist.yin')
@@ -95,14 +108,13 @@ function datastore:get()
 	doc = xmlwrap.new_xml_doc(self.model_name, self.model_ns);
 	root = doc:root();
 
-	local file = io.open(HIST_FILE);
-	if not file then
+	local content = read_file(HIST_FILE);
+	if not content then
 		return nil, "Cannot open file with history: " .. HIST_FILE;
 	end
-	parse_file(file, root:add_child('snapshots'));
-	file:close();
+	root:add_tree(parse_file(content));
 
-	return doc:strdump();
+	return doc;
 end
 
 register_datastore_provider(datastore)
@@ -21,12 +21,13 @@ require("datastore");
 require("nutils");
 
 local datastore = datastore("network.yin");
+datastore.user_rpc_parsed = true;
 local empty_node = {
 	text = function() return nil ; end
 };
 
 function datastore:user_rpc(rpc, data)
-	local xml = xmlwrap.read_memory(data);
+	local xml = data;
 	local root = xml:root();
 
 	if rpc == 'ping' then
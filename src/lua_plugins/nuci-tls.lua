@@ -21,6 +21,7 @@ require("datastore");
 require("nutils");
 
 local datastore = datastore("nuci-tls.yin");
+datastore.user_rpc_parsed = true;
 local dir = '/usr/share/nuci/tls/ca/';
 local token_dir = '/usr/share/nuci/tls/clients/';
 local script_dir = '/usr/share/nuci/tls/';
@@ -38,7 +39,7 @@ function datastore:get()
 	-- check the lockfile whether the CA is not being generated
 	if file_exists('/tmp/nuci-tls-generate-CA') then
 		root:add_child("generating");
-		return xml:strdump();
+		return xml;
 	end
 
 	local index, err = io.open(index_file);
@@ -66,7 +67,7 @@ function datastore:get()
 			end
 		end
 	end
-	return xml:strdump();
+	return xml;
 end
 
 local function check_name(name)
@@ -74,7 +75,7 @@ local function check_name(name)
 end
 
 function datastore:user_rpc(rpc, data)
-	local xml = xmlwrap.read_memory(data);
+	local xml = data;
 	local root = xml:root();
 	if rpc == 'get-token' then
 		local node = find_node_name_ns(root, 'name', self.model_ns);
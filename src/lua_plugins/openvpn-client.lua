@@ -23,6 +23,7 @@ require("nutils");
 require("uci");
 
 local datastore = datastore('openvpn-client.yin');
+datastore.user_rpc_parsed = true;
 
 function get_wan_ip()
 	local ecode, stdout, stderr = run_command(
@@ -165,7 +166,7 @@ verb 3
 end
 
 function datastore:user_rpc(rpc, data)
-	local xml = xmlwrap.read_memory(data);
+	local xml = data;
 	local root = xml:root();
 
 	if rpc == 'download-config' then
@@ -20,9 +20,10 @@ along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
 require("datastore");
 
 local datastore = datastore("password.yin");
+datastore.user_rpc_parsed = true;
 
 function datastore:user_rpc(rpc, data)
-	local xml = xmlwrap.read_memory(data);
+	local xml = data;
 	local root = xml:root();
 
 	if rpc == 'set' then
@@ -21,6 +21,7 @@ require("datastore");
 require("nutils");
 
 local datastore = datastore('registration.yin');
+datastore.user_rpc_parsed = true;
 
 -- Where we get the challenge
 local challenge_url = 'https://api.turris.cz/challenge.cgi';
@@ -55,7 +56,7 @@ function get_registration_code()
 end
 
 function datastore:user_rpc(rpc, data)
-	local xml = xmlwrap.read_memory(data);
+	local xml = data;
 	local root = xml:root();
 
 	if rpc == 'get' then
@@ -98,26 +98,15 @@ local function cmd_interfaces(node)
 	end
 	-- Return? True = is bridge; False = is not bridge; nil = error
 	local process_bridge = function (node, iface)
-		local file, errstr = io.open("/sys/devices/virtual/net/" .. iface .. "/bridge/bridge_id");
-		local bridge_id = nil;
-		if file then
-			for line in file:lines() do
-				bridge_id = line;
-				break; --get only one line
-			end
-			file:close();
-		end
+		local content, errstr = read_file("/sys/devices/virtual/net/" .. iface .. "/bridge/bridge_id");
+		local bridge_id = content and content:match('^[^\n]*'); --get only one line
 
 		if bridge_id then
 			local stp_state;
 			-- OK, this device id bridge, get more info
-			file, errstr = io.open("/sys/devices/virtual/net/" .. iface .. "/bridge/stp_state");
-			if file then
-				for line in file:lines() do
-					stp_state = line;
-					break; --get only one line
-				end
-				file:close();
+			content, errstr = read_file("/sys/devices/virtual/net/" .. iface .. "/bridge/stp_state");
+			if content then
+				stp_state = content:match('^[^\n]*'); --get only one line
 			else
 				return nil, "Cannot open file stp_state."
 			end
@@ -144,12 +133,12 @@ local function cmd_interfaces(node)
 	end
 
 	-- Return? True = is wireless; False = is not wireless; nil = error
-	local process_wireless = function (node, iface)
-		local ecode, stdout, stderr = run_command(nil, "iw", "dev", iface, "info");
-		if ecode ~= 0 then
+	local process_wireless = function (node, iw)
+		if iw.info.code ~= 0 then
 			node:delete();
 			return false;
 		end
+		local stdout = iw.info.stdout;
 
 		-- For debug purposes
 		--stdout =
@@ -167,10 +156,10 @@ local function cmd_interfaces(node)
 		if channel then node:add_child('channel'):set_text(channel); end
 		if frequency then node:add_child('frequency'):set_text(frequency); end
 
-		ecode, stdout, stderr = run_command(nil, "iw", "dev", iface, "station", "dump");
-		if ecode ~= 0 then
+		if iw.stations.code ~= 0 then
 			return nil, "Cannot get clients info";
 		end
+		stdout = iw.stations.stdout;
 
 		-- For debug purposes
 		--stdout =
@@ -234,15 +223,13 @@ local function cmd_interfaces(node)
 		return true;
 	end
 
-	-- Run first command
-	local ecode, stdout, stderr = run_command(nil, 'ip', 'addr', 'show');
-	if ecode ~= 0 then
-		return nil, "Command to get interfaces failed with code " .. ecode .. " and stderr " .. stderr;
-	end
+	-- Run first command and parse its output as it comes
+	local ip_lines, ip_proc = run_command_lines(nil, 'ip', 'addr', 'show');
 
 	--Parse ip output
 	local iface_node; --node for new interface and its address list
-	for line in lines(stdout) do
+	local wireless = {}; -- The wireless nodes, filled in once we have the info from iw
+	for line in ip_lines do
 		-- Check if it is first line defining new interface
 		local num, name = line:match('(%d*):%s+([^:@]*)[:@]');
 		if num and name then
@@ -257,13 +244,10 @@ local function cmd_interfaces(node)
 			-- Try bridge
 			local brstatus, err = process_bridge(iface_node:add_child('bridge'), name);
 			if brstatus == nil then
+				ip_proc:finish();
 				return nil, err;
 			end
-			-- Try wireless
-			local wrstatus, err = process_wireless(iface_node:add_child('wireless'), name);
-			if wrstatus == nil then
-				return nil, err;
-			end
+			table.insert(wireless, { name = name, node = iface_node:add_child('wireless') });
 		else
 			-- OK, it isn't first line of new interface
 			-- Try to get address
@@ -278,6 +262,28 @@ local function cmd_interfaces(node)
 				-- else: do nothing, it's some uninteresting garbage
 		end
 	end
+	local ecode, stderr = ip_proc:finish();
+	if ecode ~= 0 then
+		return nil, "Command to get interfaces failed with code " .. ecode .. " and stderr " .. stderr;
+	end
+
+	-- Ask iw about all the interfaces at once, it takes only as long as the slowest one
+	local iw_commands = {};
+	for _, iface in ipairs(wireless) do
+		table.insert(iw_commands, { "iw", "dev", iface.name, "info" });
+		table.insert(iw_commands, { "iw", "dev", iface.name, "station", "dump" });
+	end
+	local iw_results = run_commands(iw_commands);
+	for i, iface in ipairs(wireless) do
+		-- Try wireless
+		local wrstatus, err = process_wireless(iface.node, {
+			info = iw_results[2 * i - 1],
+			stations = iw_results[2 * i]
+		});
+		if wrstatus == nil then
+			return nil, err;
+		end
+	end
 
 	return true;
 end
@@ -389,12 +395,19 @@ local commands = {
 	},
 	{
 		element = "kernel-version",
-		cmd = "uname",
-		params = {'-r'}
+		native = function ()
+			return sysinfo.uname().release;
+		end
 	},
 	{
 		element = "firmware-version",
-		shell = "cat /etc/openwrt_release  | grep DISTRIB_DESCRIPTION | cut -d '\"' -f 2"
+		native = function ()
+			local release, err = sysinfo.read_kv('/etc/openwrt_release');
+			if not release then
+				return nil, err;
+			end
+			return release.DISTRIB_DESCRIPTION or '';
+		end
 	},
 	{
 		element = 'turris-os-version',
@@ -402,8 +415,9 @@ local commands = {
 	},
 	{
 		element = "local-time",
-		cmd = "date",
-		params = {'+%s'}
+		native = function ()
+			return string.format('%d', sysinfo.clock_gettime());
+		end
 	},
 	{
 		element = "load-average",
@@ -500,36 +514,38 @@ local commands = {
 	}
 };
 
-local function get_output(command)
+-- The command line to run for the command, if it is one to run
+local function command_line(command)
 	if command.shell then
-		local ecode, out, err;
 		-- Run it as a command in shell
-		ecode, out, err = run_command(nil, 'sh', '-c', command.shell);
-
-		if ecode ~= 0 then
-			return nil, "Command to get " .. command.element .. " failed with code " .. ecode .. " and stderr " .. err;
-		end
-		return out;
+		return { 'sh', '-c', command.shell };
 	end
 	if command.cmd then
-		local ecode, out, err;
-		local params = command.params or {};
-		-- Run it as a command
-		ecode, out, err = run_command(nil, command.cmd, unpack(params));
+		local line = { command.cmd };
+		for _, param in ipairs(command.params or {}) do
+			table.insert(line, param);
+		end
+		return line;
+	end
+end
 
-		if ecode ~= 0 then
-			return nil, "Command to get " .. command.element .. " failed with code " .. ecode .. " and stderr " .. err;
+--[[
+Get the output for the command. The external commands are already run
+(all at once, see datastore:get), the result of this one is passed.
+]]
+local function get_output(command, result)
+	if command.shell or command.cmd then
+		if result.code ~= 0 then
+			return nil, "Command to get " .. command.element .. " failed with code " .. result.code .. " and stderr " .. result.stderr;
 		end
-		return out;
+		return result.stdout;
+	end
+	if command.native then
+		return command.native();
 	end
 	if command.file then
-		local file, errstr = io.open(command.file);
-		if file then
-			local out = '';
-			for l in file:lines() do
-				out = out .. l .. "\n";
-			end
-			file:close();
+		local out, errstr = read_file(command.file);
+		if out then
 			return out;
 		elseif command.nofile_ok then
 			return '';
@@ -561,19 +577,83 @@ local function get_output(command)
 		end
 		return data;
 	end
-	return nil, "Confused: no cmd, file nor uci for " .. command.element;
+	return nil, "Confused: no cmd, native, file nor uci for " .. command.element;
 end
 
 local datastore = datastore('stats.yin')
+-- The dashboards poll often and the data don't change that fast
+datastore.cache_policy = { ttl = 2, commit = true, shared = 2 };
+
+-- Compute single element of the output
+local function run_single(root, command, result)
+	local node = root:add_child(command.element);
+	--run
+	if command.procedure then
+		return command.procedure(node);
+	else
+		local out, err = get_output(command, result);
+		--test errors
+		if not out then
+			return nil, err;
+		end
+		--run postproccess function
+		if command.postprocess then
+			command.postprocess(node, out);
+		else
+			--clean output
+			out = trimr(out);
+			node:set_text(xml_escape(out));
+		end
+		return true;
+	end
+end
 
-function datastore:get()
-	local doc, root, node;
+--[[
+Find out which elements the filter asks for. Returns nil if all of them
+are needed.
+]]
+local function requested_elements(filter, ns)
+	if not filter then
+		return nil;
+	end
+	local result = {};
+	for child in filter:iterate() do
+		local name, child_ns = child:name();
+		if child_ns and child_ns ~= ns then
+			-- Something from another namespace, we don't know what it means
+			return nil;
+		end
+		result[name] = true;
+	end
+	if not next(result) then
+		-- The <stats/> without content selects everything
+		return nil;
+	end
+	--[[
+	The board name is needed by other elements (and is cheap),
+	keep it always.
+	]]
+	result['board-name'] = true;
+	return result;
+end
 
-	local code, utc_time, stderr = run_command(nil, 'date', '-Iseconds', '-u', '+%s');
-	if code ~= 0 then
-		return nil, "Could not determine UTC time: " .. stderr;
+function datastore:get(filter)
+	local doc, root;
+	local requested = requested_elements(filter, self.model_ns);
+
+	timestamp = math.floor(sysinfo.clock_gettime());
+
+	-- Start all the commands at once, so we wait only for the slowest one
+	local batch = {};
+	local batch_index = {};
+	for _, command in ipairs(commands) do
+		local line = command_line(command);
+		if line and (not requested or requested[command.element]) then
+			table.insert(batch, line);
+			batch_index[command] = #batch;
+		end
 	end
-	timestamp = trimr(utc_time);
+	local results = run_commands(batch);
 
 	--prepare XML subtree
 	doc = xmlwrap.new_xml_doc(self.model_name, self.model_ns);
@@ -581,33 +661,16 @@ function datastore:get()
 
 	--run single commands
 	for i, command in ipairs(commands) do
-		node = root:add_child(command.element);
-		--run
-		if command.procedure then
-			local out, err = command.procedure(node);
-			if not out then
+		if not requested or requested[command.element] then
+			local ok, err = run_single(root, command, results[batch_index[command]]);
+			if not ok then
 				reset_uci_cursor();
 				return nil, err;
 			end
-		else
-			local out, err = get_output(command);
-			--test errors
-			if not out then
-				reset_uci_cursor();
-				return nil, err;
-			end
-			--run postproccess function
-			if command.postprocess then
-				command.postprocess(node, out);
-			else
-				--clean output
-				out = trimr(out);
-				node:set_text(xml_escape(out));
-			end
 		end
 	end
 	reset_uci_cursor();
-	return doc:strdump();
+	return doc;
 end
 
 register_datastore_provider(datastore)
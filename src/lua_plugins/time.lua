@@ -21,6 +21,7 @@ require("datastore");
 require("nutils");
 
 local datastore = datastore("time.yin");
+datastore.user_rpc_parsed = true;
 
 function datastore:get()
 	local xml = xmlwrap.new_xml_doc(self.model_name, self.model_ns);
@@ -32,20 +33,11 @@ function datastore:get()
 	end);
 	reset_uci_cursor();
 
-	local code, local_time, stderr = run_command(nil, 'date', '-Iseconds');
-	if code ~= 0 then
-		return nil, "Could not determine local time: " .. stderr;
-	end
-	local code, utc_time, stderr = run_command(nil, 'date', '-Iseconds', '-u');
-	if code ~= 0 then
-		return nil, "Could not determine UTC time: " .. stderr;
-	end
-
 	root:add_child('timezone'):set_text(timezone);
-	root:add_child('local'):set_text(trimr(local_time));
-	root:add_child('utc'):set_text(trimr(utc_time));
+	root:add_child('local'):set_text(sysinfo.date());
+	root:add_child('utc'):set_text(sysinfo.date(nil, true));
 
-	return xml:strdump();
+	return xml;
 end
 
 local function systohc()
@@ -58,7 +50,7 @@ local function systohc()
 end
 
 function datastore:user_rpc(rpc, data)
-	local xml = xmlwrap.read_memory(data);
+	local xml = data;
 	local root = xml:root();
 
 	if rpc == 'set' then
@@ -39,66 +39,143 @@ local function sort_by_index(input)
 	return result;
 end
 
-local function list_item(name, value)
-	local result;
+local function list_item(writer, name, value)
 	if type(value) == 'table' then
-		result = '<list><name>' .. xml_escape(name) .. '</name>';
+		writer:start('list'):element('name', name);
 		for index, value in ipairs(value) do
-			result = result .. '<value><index>' .. xml_escape(index) .. '</index><content>' .. xml_escape(value) .. '</content></value>';
+			writer:start('value'):element('index', index):element('content', value):close();
 		end
-		result = result .. '</list>';
+		writer:close();
 	else
-		result = '<option><name>' .. xml_escape(name) .. '</name><value>' .. xml_escape(value) .. '</value></option>';
+		writer:start('option'):element('name', name):element('value', value):close();
 	end
-	return result;
 end
 
-local function list_section(section)
-	local result = "<section><name>" .. xml_escape(section[".name"]) .. "</name><type>" .. xml_escape(section[".type"]) .. "</type>";
+local function list_section(writer, section)
+	writer:start('section'):element('name', section[".name"]):element('type', section[".type"]);
 	if section[".anonymous"] then
-		result = result .. "<anonymous/>";
+		writer:element('anonymous');
 	end
 	for name, value in pairs(section) do
 		if not name:find("^%.") then -- Stuff starting with dot is special info, not values
-			result = result .. list_item(name, value);
+			list_item(writer, name, value);
 		end
 	end
-	result = result .. '</section>';
-	return result;
+	writer:close();
 end
 
-function uci_datastore:list_config(cursor, config)
-	local result = '<config><name>' .. xml_escape(config) .. '</name>';
+function uci_datastore:list_config(writer, cursor, config)
 	local cdata, errstr = cursor:get_all(config);
 	errstr = errstr or 'unknown error';
 	if not cdata then
 		nlog(NLOG_WARN, "Bad config '" .. config .. "': " .. errstr);
 		self.config_errors[config] = errstr;
-		return '';
+		return;
 	end
+	writer:start('config'):element('name', config);
 	-- Sort the data according to their index
 	-- (this might not preserve the order between types, but at least
 	-- preserves the relative order inside one type).
 	cdata = sort_by_index(cdata);
 	for _, section in ipairs(cdata) do
-		result = result .. list_section(section);
+		list_section(writer, section);
 	end
-	result = result .. '</config>';
-	return result;
+	writer:close();
 end
 
-function uci_datastore:get_config()
+-- Dump the given configs, in the given order
+function uci_datastore:dump_configs(configs)
 	local cursor = get_uci_cursor();
-	local result = [[<uci xmlns='http://www.nic.cz/ns/router/uci-raw'>]];
-	local configs = uci_list_configs();
-	table.sort(configs);
+	-- Stream it, the configs can be large and concatenating the strings is slow
+	local writer = xmlwrap.writer();
+	writer:start('uci', self.model_ns);
 	self.config_errors = {}
-	for _, config in ipairs(uci_list_configs()) do
-		result = result .. self:list_config(cursor, config);
+	local batch = {};
+	local function flush()
+		if next(batch) then
+			local xml, errors = uci_raw_dump(batch);
+			writer:raw(xml);
+			for config, err in pairs(errors) do
+				self.config_errors[config] = err;
+			end
+			batch = {};
+		end
 	end
-	result = result .. '</uci>';
+	for _, config in ipairs(configs) do
+		if commit_is_dirty(config) then
+			-- The native dump reads the files and doesn't see the changes in our cursor
+			flush();
+			self:list_config(writer, cursor, config);
+		else
+			table.insert(batch, config);
+		end
+	end
+	flush();
 	reset_uci_cursor();
-	return result;
+	return writer:finish();
+end
+
+local function sorted_configs()
+	local configs = uci_list_configs();
+	table.sort(configs);
+	return configs;
+end
+
+function uci_datastore:get_config()
+	return self:dump_configs(sorted_configs());
+end
+
+local netconf_ns = 'urn:ietf:params:xml:ns:netconf:base:1.0';
+
+--[[
+Set of the configs the edit touches, or nil if it may touch all of them
+(replace or other operation on the whole <uci>, unnamed <config>, ...).
+]]
+function uci_datastore:edit_touched_configs(operation, defop)
+	if defop == 'replace' then
+		return nil;
+	end
+	local touched = {};
+	-- The parsed command keeps the whitespace between the elements, skip it
+	for top in operation:root():iterate() do
+		if top:type() == 'XML_ELEMENT_NODE' then
+			local name, ns = top:name();
+			if name ~= 'uci' or ns ~= self.model_ns or top:attribute('operation', netconf_ns) then
+				return nil;
+			end
+			for config in top:iterate() do
+				if config:type() == 'XML_ELEMENT_NODE' then
+					local name, ns = config:name();
+					local config_name = self:subnode_value(config, 'name');
+					if name ~= 'config' or ns ~= self.model_ns or not config_name then
+						return nil;
+					end
+					touched[config_name] = true;
+				end
+			end
+		end
+	end
+	return touched;
+end
+
+-- Load only the configs the edit touches, the rest doesn't influence it
+function uci_datastore:edit_config_current(operation, defop)
+	local configs = sorted_configs();
+	local touched = self:edit_touched_configs(operation, defop);
+	if touched then
+		local selected = {};
+		for _, config in ipairs(configs) do
+			if touched[config] then
+				table.insert(selected, config);
+				touched[config] = nil;
+			end
+		end
+		if not next(touched) then
+			return self:dump_configs(selected);
+		end
+		-- Creating a new config (or a name we don't understand), let editconfig see everything
+	end
+	return self:dump_configs(configs);
 end
 
 function uci_datastore:subnode_value(node, name)
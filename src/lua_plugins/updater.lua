@@ -20,6 +20,7 @@ along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
 require("datastore");
 
 local datastore = datastore("updater.yin");
+datastore.user_rpc_parsed = true;
 
 local state_dir = '/tmp/update-state';
 local approval_file_name = '/usr/share/updater/approvals';
@@ -201,7 +202,7 @@ function datastore:get()
 		current_req_file:close();
 	end
 
-	return xml:strdump();
+	return xml;
 end
 
 function datastore:user_rpc(rpc, data)
@@ -218,7 +219,7 @@ function datastore:user_rpc(rpc, data)
 		else
 			nst = 'denied'
 		end
-		local xml = xmlwrap.read_memory(data);
+		local xml = data;
 		local root = xml:root();
 		local ids = {}
 		for child in root:iterate() do
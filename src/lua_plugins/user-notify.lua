@@ -21,6 +21,7 @@ require("datastore");
 require("nutils");
 
 local datastore = datastore("user-notify.yin");
+datastore.user_rpc_parsed = true;
 
 local dir = '/tmp/user_notify'
 local test_dir = '/tmp/user_notify_test'
@@ -41,7 +42,7 @@ end
 local severities = { restart = true, error = true, update = true, news = true };
 
 function datastore:user_rpc(rpc, data)
-	local xml = xmlwrap.read_memory(data);
+	local xml = data;
 	local root = xml:root();
 
 	if rpc == 'message' then
@@ -185,12 +186,13 @@ function datastore:get()
 				end
 			end
 		end
-		return xml:strdump();
+		return xml;
 	end);
 	run_command(nil, 'sh', '-c', 'rm -rf ' .. dir .. '/.locked');
 	if ok then
 		return result;
 	else
+		budget_rethrow(result);
 		return nil, result;
 	end
 end
@@ -20,11 +20,15 @@
 #include "communication.h"
 #include "interpreter.h"
 #include "register.h"
+#include "workers.h"
+#include "model.h"
+#include "server.h"
 #include "logging.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include <libnetconf.h>
 #include <libxml/parser.h>
@@ -42,7 +46,19 @@ static void callback_print(NC_VERB_LEVEL level, const char *msg) {
 
 int main(int argc, char *argv[]) {
 	int opt;
-	while ((opt = getopt(argc, argv, "s:e:h")) != -1) {
+	const char *socket_path = NULL;
+	bool zygote = false;
+	int rpc_budget = 0;
+	int worker_count = 0;
+	const struct option long_options[] = {
+		{ "server", required_argument, NULL, 'S' },
+		{ "zygote", required_argument, NULL, 'z' },
+		{ "budget", required_argument, NULL, 'T' },
+		{ "workers", required_argument, NULL, 'w' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	while ((opt = getopt_long(argc, argv, "s:e:S:z:T:w:h", long_options, NULL)) != -1) {
 		switch (opt) {
 			case 'e':
 				log_set_stderr(get_log_level(optarg));
@@ -50,8 +66,26 @@ int main(int argc, char *argv[]) {
 			case 's':
 				log_set_syslog(get_log_level(optarg));
 				break;
+			case 'S':
+				socket_path = optarg;
+				zygote = false;
+				break;
+			case 'z':
+				socket_path = optarg;
+				zygote = true;
+				break;
+			case 'T':
+				rpc_budget = atoi(optarg);
+				break;
+			case 'w':
+				worker_count = atoi(optarg);
+				break;
 			default:
 				printf("-e level or -s level -- set logging to stderr or syslog to given level\n");
+				printf("-S path or --server=path -- run as a server, accepting sessions on unix socket at path\n");
+				printf("-z path or --zygote=path -- like --server, but fork a process for each session\n");
+				printf("-T seconds or --budget=seconds -- limit how long external commands of single RPC may run\n");
+				printf("-w count or --workers=count -- compute the state of the data stores in that many threads\n");
 				break;
 		}
 	}
@@ -75,15 +109,40 @@ int main(int argc, char *argv[]) {
 		//error message was generated by callback_print
 		return 1;
 	}
+	global_srv_config.rpc_budget = rpc_budget;
+	if (worker_count > 0) {
+		global_srv_config.workers = workers_create(worker_count, PLUGIN_PATH "/lua_plugins");
+		if (!global_srv_config.workers)
+			return 1;
+	}
 
-	comm_start_loop(&global_srv_config);
+	bool ok = true;
+	if (socket_path && zygote) {
+		ok = server_run_zygote(&global_srv_config, socket_path);
+	} else if (socket_path) {
+		ok = server_run(&global_srv_config, socket_path);
+	} else {
+		// Single session on stdin & stdout
+		struct srv_session *session = comm_session_accept(&global_srv_config, STDIN_FILENO, STDOUT_FILENO, NULL);
+		if (session) {
+			comm_start_loop(&global_srv_config, session);
+			comm_session_free(session);
+		} else {
+			ok = false;
+		}
+	}
 	comm_cleanup(&global_srv_config);
 
+	if (global_srv_config.workers)
+		workers_destroy(global_srv_config.workers);
+
 	interpreter_destroy(interpreter);
+	// Lua might have referenced the models until now
+	model_registry_free();
 
 	//Clean up phase of libxml2
 	xmlCleanupParser();
 	xmlMemoryDump();
 
-	return 0;
+	return ok ? 0 : 1;
 }
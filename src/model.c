@@ -38,26 +38,29 @@ char *model_path(const char *model_file) {
 	return filename;
 }
 
-/*
- * Take the model spec (yin) specs and extract the namespace uri of the model.
- * Pass the result onto the caller for free.
- */
-static char *extract_model_uri(xmlDoc *doc) {
+const char *model_doc_ns(const struct _xmlDoc *doc) {
 	assert(doc); // By now, someone should have validated the model before us.
 	xmlNode *node = xmlDocGetRootElement(doc);
 	assert(node);
-	char *model_uri = NULL;
 	for (xmlNode *current = node->children; current; current = current->next) {
-		if (xmlStrcmp(current->name, (const xmlChar *) "namespace") == 0 && xmlStrcmp(current->ns->href, (const xmlChar *) "urn:ietf:params:xml:ns:yang:yin:1") == 0) {
-			xmlChar *uri = xmlGetNoNsProp(current, (const xmlChar *) "uri");
-			// Get a proper string, not some xml* beast.
-			model_uri = strdup((const char *) uri);
-			xmlFree(uri);
-			break;
+		if (current->type == XML_ELEMENT_NODE && xmlStrcmp(current->name, (const xmlChar *) "namespace") == 0 && current->ns && xmlStrcmp(current->ns->href, (const xmlChar *) "urn:ietf:params:xml:ns:yang:yin:1") == 0) {
+			xmlAttr *uri = xmlHasNsProp(current, (const xmlChar *) "uri", NULL);
+			if (uri && uri->children && uri->children->content)
+				return (const char *) uri->children->content;
+			return NULL;
 		}
 	}
-	xmlFreeDoc(doc);
-	return model_uri;
+	return NULL;
+}
+
+/*
+ * Take the model spec (yin) specs and extract the namespace uri of the model.
+ * Pass the result onto the caller for free.
+ */
+static char *extract_model_uri(xmlDoc *doc) {
+	const char *uri = model_doc_ns(doc);
+	// Get a proper string, not some xml* beast.
+	return uri ? strdup(uri) : NULL;
 }
 
 /*
@@ -74,14 +77,51 @@ static char *extract_model_name(xmlDoc *doc) {
 	return result;
 }
 
-char *extract_model_uri_string(const char *model) {
-	return extract_model_uri(xmlReadMemory(model, strlen(model), "model.xml", NULL, 0));
-}
+/*
+ * The registry of parsed models. There's only few of them and they are
+ * looked up only during the startup, so simple array is enough. It holds
+ * pointers, so the models don't move when it grows.
+ */
+static struct model **models;
+static size_t model_count, model_capacity;
 
-char *extract_model_uri_file(const char *file) {
-	return extract_model_uri(xmlParseFile(file));
+const struct model *model_get(const char *model_file) {
+	for (size_t i = 0; i < model_count; i ++)
+		if (strcmp(models[i]->file, model_file) == 0)
+			return models[i];
+
+	char *path = model_path(model_file);
+	xmlDoc *doc = xmlParseFile(path);
+	if (!doc) {
+		free(path);
+		return NULL;
+	}
+	if (model_count == model_capacity) {
+		model_capacity = model_capacity ? 2 * model_capacity : 16;
+		models = realloc(models, model_capacity * sizeof *models);
+	}
+	struct model *model = malloc(sizeof *model);
+	models[model_count ++] = model;
+	*model = (struct model) {
+		.file = strdup(model_file),
+		.path = path,
+		.ns = extract_model_uri(doc),
+		.name = extract_model_name(doc),
+		.doc = doc
+	};
+	return model;
 }
 
-char *extract_model_name_file(const char *file) {
-	return extract_model_name(xmlParseFile(file));
+void model_registry_free(void) {
+	for (size_t i = 0; i < model_count; i ++) {
+		free(models[i]->file);
+		free(models[i]->path);
+		free(models[i]->ns);
+		free(models[i]->name);
+		xmlFreeDoc(models[i]->doc);
+		free(models[i]);
+	}
+	free(models);
+	models = NULL;
+	model_count = model_capacity = 0;
 }
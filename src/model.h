@@ -24,16 +24,36 @@
  * Bunch of utility functions to handling the models for netconf.
  */
 
+struct _xmlDoc;
+
 // Get the full path of a model specified by the file name. Return value allocated and ownership passed onto the caller.
 char *model_path(const char *model_file);
 
 /*
- * Take the model spec (yin) specs and extract the namespace uri of the model.
- * Pass the result onto the caller for free.
+ * Find the namespace uri of already parsed model. No copy is made, the result
+ * points inside the document. NULL if the model has no namespace.
+ */
+const char *model_doc_ns(const struct _xmlDoc *doc);
+
+/*
+ * A parsed model, with the interesting bits already extracted.
+ */
+struct model {
+	char *file; // The file name, as the plugin specified it
+	char *path; // The full path to the file
+	char *ns; // The namespace uri of the model
+	char *name; // Name of the model
+	struct _xmlDoc *doc; // The parsed yin
+};
+
+/*
+ * Get the model specified by the file name. It is parsed the first time
+ * it is asked for and cached afterwards, so each one is parsed only once.
+ * The result is owned by the registry and is valid until
+ * model_registry_free is called. Returns NULL if the model can't be parsed.
  */
-char *extract_model_uri_string(const char *model);
-char *extract_model_uri_file(const char *file);
-// Similar, but extract the name
-char *extract_model_name_file(const char *file);
+const struct model *model_get(const char *model_file);
+// Free all the cached models. Nothing may use them after this.
+void model_registry_free(void);
 
 #endif
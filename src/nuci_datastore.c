@@ -18,6 +18,8 @@
  */
 
 #include "nuci_datastore.h"
+#include "communication.h"
+#include "filter.h"
 #include "configuration.h"
 #include "logging.h"
 
@@ -41,10 +43,11 @@ struct nuci_lock_info {
 };
 
 struct nuci_ds_data {
-	struct nuci_lock_info *lock_info;
+	// The lock info, interpreter and filter live here
+	const struct srv_config *config;
 	bool lock_master;
-	struct interpreter *interpreter;
 	lua_datastore datastore;
+	const char *ns;
 };
 
 struct nuci_lock_info *lock_info_create(void) {
@@ -52,7 +55,12 @@ struct nuci_lock_info *lock_info_create(void) {
 
 	info->holding_lock = false;
 
-	//is important to have acces to lockfile before we start
+	/*
+	 * is important to have acces to lockfile before we start
+	 *
+	 * Each session opens the file on its own. The flock belongs to the open file,
+	 * so sessions in the same process exclude each other too.
+	 */
 	info->lockfile = open(NUCI_LOCKFILE, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 	if (info->lockfile == -1) {
 		die("Couldn't create lock file %s: %s", NUCI_LOCKFILE, strerror(errno));
@@ -68,13 +76,13 @@ void lock_info_free(struct nuci_lock_info *info) {
 	free(info);
 }
 
-struct nuci_ds_data *nuci_ds_get_custom_data(struct nuci_lock_info *info, struct interpreter *interpreter, lua_datastore datastore, bool locking_enabled) {
+struct nuci_ds_data *nuci_ds_get_custom_data(const struct srv_config *config, lua_datastore datastore, const char *ns, bool locking_enabled) {
 	struct nuci_ds_data *data = calloc(1, sizeof *data);
 
-	data->lock_info = info;
+	data->config = config;
 	data->lock_master = locking_enabled;
-	data->interpreter = interpreter;
 	data->datastore = datastore;
+	data->ns = ns;
 
 	return data;
 }
@@ -182,7 +190,7 @@ static int nuci_ds_lock(void *data, NC_DATASTORE target, const char* session_id,
 	}
 
 	//I currently have lock. No double-locking.
-	if (d->lock_info->holding_lock) {
+	if (d->config->lock_info->holding_lock) {
 		*error = nc_err_new(NC_ERR_LOCK_DENIED);
 		return EXIT_FAILURE;
 	}
@@ -190,7 +198,7 @@ static int nuci_ds_lock(void *data, NC_DATASTORE target, const char* session_id,
 	//I haven't lock
 
 	//data->lockfile consistency is garanted by nuci_ds_init()
-	if (!test_and_set_lock(d->lock_info)) {
+	if (!test_and_set_lock(d->config->lock_info)) {
 		*error = nc_err_new(NC_ERR_LOCK_DENIED);
 		return EXIT_FAILURE;
 	}
@@ -220,8 +228,8 @@ static int nuci_ds_unlock(void *data, NC_DATASTORE target, const char* session_i
 	}
 
 	//I have lock -> release it.
-	if (d->lock_info->holding_lock) { //if a have lock
-		if (!release_lock(d->lock_info)) { //release it
+	if (d->config->lock_info->holding_lock) { //if a have lock
+		if (!release_lock(d->config->lock_info)) { //release it
 			*error = nc_err_new(NC_ERR_OP_FAILED);
 			return EXIT_FAILURE;
 		}
@@ -246,10 +254,14 @@ static char* nuci_ds_getconfig(void *data, NC_DATASTORE target, struct nc_err**
 		return NULL;
 	}
 
+	// Nothing from this data store can get through the filter, don't bother
+	if (!filter_selects(d->config->filter, d->ns))
+		return strdup("");
+
 	// Call out to lua
-	const char *result = interpreter_get(d->interpreter, d->datastore, "get_config");
+	const char *result = interpreter_get(d->config->interpreter, d->datastore, "get_config", filter_subtree(d->config->filter, d->ns));
 
-	*error = nc_err_create_from_lua(d->interpreter, *error);
+	*error = nc_err_create_from_lua(d->config->interpreter, *error);
 	if (result)
 		return strdup(result);
 	else
@@ -285,7 +297,7 @@ static int nuci_ds_editconfig(void *data, const nc_rpc* rpc, NC_DATASTORE target
 		return EXIT_FAILURE;
 	}
 
-	if (!test_access_status(d->lock_info)) {
+	if (!test_access_status(d->config->lock_info)) {
 		*error = nc_err_new(NC_ERR_IN_USE);
 		return EXIT_FAILURE;
 	}
@@ -325,9 +337,9 @@ static int nuci_ds_editconfig(void *data, const nc_rpc* rpc, NC_DATASTORE target
 			assert(0);
 	}
 
-	interpreter_set_config(d->interpreter, d->datastore, config, op, err);
+	interpreter_set_config(d->config->interpreter, d->datastore, config, op, err);
 
-	return (*error = nc_err_create_from_lua(d->interpreter, *error)) ? EXIT_FAILURE : EXIT_SUCCESS;
+	return (*error = nc_err_create_from_lua(d->config->interpreter, *error)) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 const struct ncds_custom_funcs *ds_funcs = &(struct ncds_custom_funcs) {
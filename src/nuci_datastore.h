@@ -35,7 +35,15 @@ struct nuci_lock_info;
 struct nuci_lock_info *lock_info_create(void);
 void lock_info_free(struct nuci_lock_info *info);
 
-//Get pointer to datastore's custom data
-struct nuci_ds_data *nuci_ds_get_custom_data(struct nuci_lock_info *lock_info, struct interpreter *interpreter, lua_datastore datastore, bool locking_enabled);
+struct srv_config;
+
+/*
+ * Get pointer to datastore's custom data.
+ *
+ * The data store looks into the server configuration for the lock info
+ * and filter of the RPC being served, since one process may serve
+ * multiple sessions. The ns is the namespace of the data store.
+ */
+struct nuci_ds_data *nuci_ds_get_custom_data(const struct srv_config *config, lua_datastore datastore, const char *ns, bool locking_enabled);
 
 #endif // NUCI_DATASTORE_H
@@ -0,0 +1,441 @@
+/*
+ * Copyright 2013, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of NUCI configuration server.
+ *
+ * NUCI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * NUCI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// For SO_PEERCRED and accept4
+#define _GNU_SOURCE
+
+#include "server.h"
+#include "communication.h"
+#include "interpreter.h"
+#include "workers.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pwd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/*
+ * How long (in seconds) a client may take to finish its hello or to send the
+ * rest of a started message. All the sessions wait for it meanwhile.
+ */
+#define CLIENT_TIMEOUT 3
+
+// One connected client
+struct client {
+	int fd;
+	struct srv_session *session;
+};
+
+static volatile sig_atomic_t terminate = 0;
+
+static void terminate_handler(int signum) {
+	(void) signum;
+	terminate = 1;
+}
+
+/*
+ * Libnetconf reads the hello and the messages in a blocking way and the
+ * whole server waits for it. A client that stops sending in the middle
+ * would stop all the other sessions. So the reading is guarded by a
+ * watchdog thread. If the client doesn't finish in time, its socket is
+ * shut down, which makes libnetconf see the end of it and give up.
+ */
+static struct watchdog {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool started, quit;
+	int fd; // The socket being read, -1 if none
+	unsigned armed; // Changes with each arm, so a new read isn't mistaken for the old one
+	struct timespec deadline; // CLOCK_MONOTONIC
+} watchdog = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1
+};
+
+static void *watchdog_run(void *data) {
+	(void) data;
+	pthread_mutex_lock(&watchdog.mutex);
+	while (!watchdog.quit) {
+		if (watchdog.fd == -1) {
+			pthread_cond_wait(&watchdog.cond, &watchdog.mutex);
+			continue;
+		}
+		unsigned armed = watchdog.armed;
+		int result = pthread_cond_timedwait(&watchdog.cond, &watchdog.mutex, &watchdog.deadline);
+		if (result == ETIMEDOUT && watchdog.fd != -1 && watchdog.armed == armed) {
+			nlog(NLOG_WARN, "Client on fd %d too slow, dropping it", watchdog.fd);
+			shutdown(watchdog.fd, SHUT_RDWR);
+			watchdog.fd = -1;
+		}
+	}
+	pthread_mutex_unlock(&watchdog.mutex);
+	return NULL;
+}
+
+static void watchdog_start(void) {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&watchdog.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	// The signals are for the main loop
+	sigset_t all, orig;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &orig);
+	int error = pthread_create(&watchdog.thread, NULL, watchdog_run, NULL);
+	pthread_sigmask(SIG_SETMASK, &orig, NULL);
+	if (error)
+		die("Couldn't start watchdog thread: %s", strerror(error));
+	watchdog.started = true;
+}
+
+static void watchdog_stop(void) {
+	if (!watchdog.started)
+		return;
+	pthread_mutex_lock(&watchdog.mutex);
+	watchdog.quit = true;
+	pthread_cond_signal(&watchdog.cond);
+	pthread_mutex_unlock(&watchdog.mutex);
+	pthread_join(watchdog.thread, NULL);
+	pthread_cond_destroy(&watchdog.cond);
+	watchdog.started = false;
+}
+
+static void watchdog_arm(int fd) {
+	pthread_mutex_lock(&watchdog.mutex);
+	clock_gettime(CLOCK_MONOTONIC, &watchdog.deadline);
+	watchdog.deadline.tv_sec += CLIENT_TIMEOUT;
+	watchdog.fd = fd;
+	watchdog.armed ++;
+	pthread_cond_signal(&watchdog.cond);
+	pthread_mutex_unlock(&watchdog.mutex);
+}
+
+static void watchdog_disarm(void) {
+	pthread_mutex_lock(&watchdog.mutex);
+	watchdog.fd = -1;
+	pthread_cond_signal(&watchdog.cond);
+	pthread_mutex_unlock(&watchdog.mutex);
+}
+
+// Reading of the RPC is done, the processing may take as long as it needs
+static void rpc_received(struct srv_config *config) {
+	(void) config;
+	watchdog_disarm();
+}
+
+static int listen_socket(const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr.sun_path) {
+		nlog(NLOG_ERROR, "Socket path %s too long", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		nlog(NLOG_ERROR, "Couldn't create socket: %s", strerror(errno));
+		return -1;
+	}
+	// Remove a stale socket from previous run, if any
+	unlink(path);
+	/*
+	 * Only our own user may connect, whatever the umask is. Create it
+	 * without permissions for the others already, so nobody can connect
+	 * before the chmod.
+	 */
+	mode_t orig_umask = umask(077);
+	int bound = bind(fd, (struct sockaddr *) &addr, sizeof addr);
+	umask(orig_umask);
+	if (bound == -1) {
+		nlog(NLOG_ERROR, "Couldn't bind socket %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (chmod(path, 0600) == -1) {
+		nlog(NLOG_ERROR, "Couldn't set permissions of socket %s: %s", path, strerror(errno));
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	if (listen(fd, SOMAXCONN) == -1) {
+		nlog(NLOG_ERROR, "Couldn't listen on socket %s: %s", path, strerror(errno));
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Find out who is on the other side of the socket, so libnetconf
+ * has the username for the session. Only root and the user we run as
+ * are allowed, the session has full access to the configuration.
+ */
+static char *peer_name(int fd) {
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+		nlog(NLOG_WARN, "Couldn't get peer credentials: %s", strerror(errno));
+		return NULL;
+	}
+	if (cred.uid != 0 && cred.uid != geteuid()) {
+		nlog(NLOG_WARN, "User %u not allowed on socket", (unsigned) cred.uid);
+		return NULL;
+	}
+	struct passwd *pw = getpwuid(cred.uid);
+	if (!pw) {
+		nlog(NLOG_WARN, "Unknown user %u on socket", (unsigned) cred.uid);
+		return NULL;
+	}
+	return strdup(pw->pw_name);
+}
+
+/*
+ * Accept a connection and establish the NETCONF session on it.
+ *
+ * The hello exchange blocks, like the one on stdio, but the client has only
+ * CLIENT_TIMEOUT seconds to do its part.
+ */
+static bool accept_client(struct srv_config *config, int listen_fd, struct client *client) {
+	int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd == -1) {
+		if (errno != EINTR && errno != EAGAIN)
+			nlog(NLOG_WARN, "Couldn't accept connection: %s", strerror(errno));
+		return false;
+	}
+	char *username = peer_name(fd);
+	if (!username) {
+		close(fd);
+		return false;
+	}
+	watchdog_arm(fd);
+	struct srv_session *session = comm_session_accept(config, fd, fd, username);
+	watchdog_disarm();
+	free(username);
+	if (!session) {
+		close(fd);
+		return false;
+	}
+	nlog(NLOG_DEBUG, "New session on fd %d", fd);
+	client->fd = fd;
+	client->session = session;
+	return true;
+}
+
+static void drop_client(struct client *client) {
+	nlog(NLOG_DEBUG, "Closing session on fd %d", client->fd);
+	comm_session_free(client->session);
+	close(client->fd);
+}
+
+/*
+ * Handle all the complete RPCs the session has. Libnetconf may have read
+ * more than one message from the socket, so we can't rely on poll to tell
+ * us about each of them.
+ *
+ * Returns false if the session is closed.
+ */
+static bool serve_client(struct srv_config *config, struct client *client) {
+	for (;;) {
+		// Disarmed by rpc_received once the message is read
+		watchdog_arm(client->fd);
+		enum comm_result result = comm_process_rpc(config, client->session, 0);
+		watchdog_disarm();
+		switch (result) {
+			case COMM_PROCESSED:
+				break;
+			case COMM_IDLE:
+				return true;
+			case COMM_CLOSED:
+				return false;
+		}
+	}
+}
+
+static void setup_signals(void) {
+	// A client disconnecting in the middle of a reply must not kill the whole server
+	signal(SIGPIPE, SIG_IGN);
+	struct sigaction action = {
+		.sa_handler = terminate_handler
+	};
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+}
+
+bool server_run(struct srv_config *config, const char *socket_path) {
+	int listen_fd = listen_socket(socket_path);
+	if (listen_fd == -1)
+		return false;
+
+	setup_signals();
+	watchdog_start();
+	config->rpc_received = rpc_received;
+
+	nlog(NLOG_INFO, "Listening on %s", socket_path);
+
+	size_t client_count = 0, client_capacity = 4;
+	struct client *clients = malloc(client_capacity * sizeof *clients);
+	struct pollfd *polls = malloc((client_capacity + 1) * sizeof *polls);
+
+	while (!terminate) {
+		// The listening socket is always the first one
+		polls[0] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+		for (size_t i = 0; i < client_count; i ++)
+			polls[i + 1] = (struct pollfd) { .fd = clients[i].fd, .events = POLLIN };
+
+		if (poll(polls, client_count + 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			die("Poll failed: %s", strerror(errno));
+		}
+
+		/*
+		 * Serve the clients first. The new one (if any) is added to the end,
+		 * so the indices of polls and clients stay in sync.
+		 */
+		size_t dst = 0;
+		for (size_t i = 0; i < client_count; i ++) {
+			bool alive = true;
+			if (polls[i + 1].revents)
+				alive = serve_client(config, &clients[i]);
+			if (alive)
+				clients[dst ++] = clients[i];
+			else
+				drop_client(&clients[i]);
+		}
+		client_count = dst;
+
+		if (polls[0].revents & POLLIN) {
+			if (client_count == client_capacity) {
+				client_capacity *= 2;
+				clients = realloc(clients, client_capacity * sizeof *clients);
+				polls = realloc(polls, (client_capacity + 1) * sizeof *polls);
+			}
+			if (accept_client(config, listen_fd, &clients[client_count]))
+				client_count ++;
+		}
+	}
+
+	nlog(NLOG_INFO, "Terminating, closing %zu sessions", client_count);
+	for (size_t i = 0; i < client_count; i ++)
+		drop_client(&clients[i]);
+	free(clients);
+	free(polls);
+	close(listen_fd);
+	unlink(socket_path);
+	config->rpc_received = NULL;
+	watchdog_stop();
+
+	return true;
+}
+
+/*
+ * The child of zygote. Serve the one session and terminate.
+ */
+static void zygote_child(struct srv_config *config, int listen_fd, int fd) __attribute__((noreturn));
+static void zygote_child(struct srv_config *config, int listen_fd, int fd) {
+	close(listen_fd);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL); // So run_command can wait for its children
+	int result = 1;
+	char *username = peer_name(fd);
+	if (username) {
+		// This opens the lock file, so the child has a lock of its own.
+		struct srv_session *session = comm_session_accept(config, fd, fd, username);
+		free(username);
+		if (session) {
+			comm_start_loop(config, session);
+			comm_session_free(session);
+			result = 0;
+		}
+	}
+	close(fd);
+	/*
+	 * Don't do the full cleanup. The libnetconf was initialized by the
+	 * zygote, not by us, and the rest dies with the process anyway.
+	 */
+	_exit(result);
+}
+
+bool server_run_zygote(struct srv_config *config, const char *socket_path) {
+	int listen_fd = listen_socket(socket_path);
+	if (listen_fd == -1)
+		return false;
+
+	setup_signals();
+	// We don't care about the children's exit status, let them not become zombies
+	struct sigaction chld_action = {
+		.sa_handler = SIG_DFL,
+		.sa_flags = SA_NOCLDWAIT
+	};
+	sigaction(SIGCHLD, &chld_action, NULL);
+
+	/*
+	 * Everything is loaded now. Clean up and freeze the lua memory, so the
+	 * children share as many pages with us as possible. The children
+	 * collect only when their memory grows a lot.
+	 */
+	interpreter_gc_freeze(config->interpreter);
+	if (config->workers)
+		workers_gc_freeze(config->workers);
+
+	nlog(NLOG_INFO, "Zygote listening on %s", socket_path);
+
+	while (!terminate) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+				nlog(NLOG_WARN, "Couldn't accept connection: %s", strerror(errno));
+			continue;
+		}
+		pid_t pid = fork();
+		switch (pid) {
+			case -1:
+				nlog(NLOG_ERROR, "Couldn't fork for new connection: %s", strerror(errno));
+				break;
+			case 0:
+				zygote_child(config, listen_fd, fd);
+			default:
+				nlog(NLOG_DEBUG, "Forked %d for new connection", (int) pid);
+				break;
+		}
+		close(fd);
+	}
+
+	nlog(NLOG_INFO, "Terminating zygote");
+	close(listen_fd);
+	unlink(socket_path);
+
+	return true;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2013, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of NUCI configuration server.
+ *
+ * NUCI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * NUCI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+
+struct srv_config;
+
+/*
+ * Run as a resident server. Listen on an unix socket on the given path
+ * and serve any number of sessions in one event loop, with the plugins
+ * and data stores from the config (which must be already initialized
+ * by comm_init).
+ *
+ * Returns when terminated by SIGTERM or SIGINT (true) or if the socket
+ * can't be set up (false).
+ */
+bool server_run(struct srv_config *config, const char *socket_path);
+
+/*
+ * Similar to server_run, but fork a child for each accepted connection.
+ * The child serves the single session, as if nuci was started just for it,
+ * but without loading the plugins again.
+ */
+bool server_run_zygote(struct srv_config *config, const char *socket_path);
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * Copyright 2013, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of NUCI configuration server.
+ *
+ * NUCI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * NUCI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shm_cache.h"
+#include "logging.h"
+
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libxml/tree.h>
+
+// A directory only root can write to, so nobody can plant a forged cache
+#define CACHE_DIR "/var/run/nuci"
+#define CACHE_PATH CACHE_DIR "/cache"
+#define CACHE_MAGIC 0x4e554332 // NUC2, change when the layout changes
+#define SLOT_COUNT 32
+#define KEY_MAX 1024
+#define DATA_MAX (64 * 1024)
+/*
+ * The lock word of a slot. The lower half is a counter, odd while somebody
+ * writes the slot. The upper half is the PID of the writer then.
+ */
+#define SEQ(lock) ((uint32_t) (lock))
+#define OWNER(lock) ((pid_t) ((lock) >> 32))
+#define LOCKED(seq, pid) (((uint64_t) (pid) << 32) | (uint32_t) (seq))
+
+struct slot {
+	uint64_t lock;
+	uint32_t generation; // Generation of the cache when the value was stored
+	uint64_t written; // Monotonic time (ms) of the write
+	uint32_t key_len;
+	uint32_t data_len;
+	char key[KEY_MAX];
+	char data[DATA_MAX];
+};
+
+struct cache {
+	uint32_t magic;
+	uint32_t generation; // Bumped to invalidate everything
+	struct slot slots[SLOT_COUNT];
+};
+
+static struct cache *mapping;
+// The worker threads may ask for the cache at the same time
+static pthread_once_t mapping_once = PTHREAD_ONCE_INIT;
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The data from the cache are served as replies, so the file must be ours
+ * and nobody else may be able to write it.
+ */
+static bool cache_trusted(const char *path, const struct stat *st, bool dir) {
+	if ((dir ? !S_ISDIR(st->st_mode) : !S_ISREG(st->st_mode)) || st->st_uid != geteuid() || (st->st_mode & (dir ? (S_IWGRP | S_IWOTH) : (S_IRWXG | S_IRWXO)))) {
+		nlog(NLOG_WARN, "Shared cache %s has wrong type, owner or permissions, not using it", path);
+		return false;
+	}
+	return true;
+}
+
+static void cache_map(void) {
+	const char *path = getenv("NUCI_SHM_CACHE");
+	if (!path) {
+		path = CACHE_PATH;
+		struct stat st;
+		if ((mkdir(CACHE_DIR, S_IRWXU) == -1 && errno != EEXIST) || lstat(CACHE_DIR, &st) == -1) {
+			nlog(NLOG_WARN, "Couldn't create directory for shared cache %s: %s", CACHE_DIR, strerror(errno));
+			return;
+		}
+		if (!cache_trusted(CACHE_DIR, &st, true))
+			return;
+	}
+	int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		nlog(NLOG_WARN, "Couldn't open shared cache %s: %s", path, strerror(errno));
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		nlog(NLOG_WARN, "Couldn't stat shared cache %s: %s", path, strerror(errno));
+		close(fd);
+		return;
+	}
+	if (!cache_trusted(path, &st, false)) {
+		close(fd);
+		return;
+	}
+	// A new file is full of zeroes, which is a valid empty cache. So is the extended part.
+	if (st.st_size < (off_t) sizeof *mapping && ftruncate(fd, sizeof *mapping) == -1) {
+		nlog(NLOG_WARN, "Couldn't size shared cache %s: %s", path, strerror(errno));
+		close(fd);
+		return;
+	}
+	struct cache *mapped = mmap(NULL, sizeof *mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		nlog(NLOG_WARN, "Couldn't map shared cache %s: %s", path, strerror(errno));
+		return;
+	}
+	uint32_t magic = 0;
+	if (!__atomic_compare_exchange_n(&mapped->magic, &magic, CACHE_MAGIC, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) && magic != CACHE_MAGIC) {
+		nlog(NLOG_WARN, "Shared cache %s has unknown format", path);
+		munmap(mapped, sizeof *mapped);
+		return;
+	}
+	mapping = mapped;
+}
+
+// Map the cache on the first use. NULL if it can't be mapped.
+static struct cache *cache_get(void) {
+	pthread_once(&mapping_once, cache_map);
+	return mapping;
+}
+
+// The key is the namespace and the filter (if any), serialized.
+static void push_key(lua_State *L) {
+	const char *ns = luaL_checkstring(L, 1);
+	lua_pushstring(L, ns);
+	if (lua_islightuserdata(L, 2)) {
+		xmlBufferPtr buffer = xmlBufferCreate();
+		xmlNodePtr filter = lua_touserdata(L, 2);
+		xmlNodeDump(buffer, filter->doc, filter, 0, 0);
+		lua_pushliteral(L, "\n");
+		lua_pushstring(L, (const char *) xmlBufferContent(buffer));
+		xmlBufferFree(buffer);
+		lua_concat(L, 3);
+	}
+}
+
+static struct slot *key_slot(struct cache *cache, const char *key, size_t len) {
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < len; i ++) {
+		hash ^= (unsigned char) key[i];
+		hash *= 16777619U;
+	}
+	return &cache->slots[hash % SLOT_COUNT];
+}
+
+/*
+ * shm_cache_get(ns, filter, max_age)
+ *
+ * Return the value stored at most max_age seconds ago, or nil.
+ */
+static int shm_cache_get_lua(lua_State *L) {
+	double max_age = luaL_checknumber(L, 3);
+	struct cache *cache = cache_get();
+	if (!cache)
+		return 0;
+	push_key(L);
+	size_t key_len;
+	const char *key = lua_tolstring(L, -1, &key_len);
+	if (key_len > KEY_MAX)
+		return 0;
+	struct slot *slot = key_slot(cache, key, key_len);
+	uint64_t lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+	if (SEQ(lock) & 1)
+		return 0; // Being written just now
+	uint32_t generation = __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+	if (slot->generation != generation || slot->key_len != key_len || memcmp(slot->key, key, key_len) != 0)
+		return 0;
+	if (now_ms() - slot->written > max_age * 1000)
+		return 0;
+	size_t data_len = slot->data_len;
+	if (data_len > DATA_MAX)
+		return 0; // Torn read, the check below would catch it too
+	char *data = malloc(data_len);
+	memcpy(data, slot->data, data_len);
+	// Make sure nobody wrote the slot while we were reading it
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) != lock) {
+		free(data);
+		return 0;
+	}
+	lua_pushlstring(L, data, data_len);
+	free(data);
+	return 1;
+}
+
+/*
+ * shm_cache_generation()
+ *
+ * The current generation of the cache, to be passed to shm_cache_put. Take
+ * it before computing the value.
+ */
+static int shm_cache_generation_lua(lua_State *L) {
+	struct cache *cache = cache_get();
+	lua_pushnumber(L, cache ? __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE) : 0);
+	return 1;
+}
+
+/*
+ * shm_cache_put(ns, filter, value, generation)
+ *
+ * Store the value computed in the given generation (from
+ * shm_cache_generation). Returns true if it was stored. It may not be if it
+ * is too large, somebody else is writing the same slot or the cache was
+ * invalidated since (the value may be outdated then).
+ */
+static int shm_cache_put_lua(lua_State *L) {
+	size_t data_len;
+	const char *data = luaL_checklstring(L, 3, &data_len);
+	uint32_t generation = luaL_checknumber(L, 4);
+	struct cache *cache = cache_get();
+	push_key(L);
+	size_t key_len;
+	const char *key = lua_tolstring(L, -1, &key_len);
+	if (!cache || key_len > KEY_MAX || data_len > DATA_MAX || __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE) != generation) {
+		lua_pushboolean(L, false);
+		return 1;
+	}
+	struct slot *slot = key_slot(cache, key, key_len);
+	uint64_t lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+	uint32_t seq = SEQ(lock);
+	/*
+	 * Somebody is writing it. Take the slot over only if the writer is dead,
+	 * a live one would go on writing into it.
+	 */
+	if ((seq & 1) && !(kill(OWNER(lock), 0) == -1 && errno == ESRCH)) {
+		lua_pushboolean(L, false);
+		return 1;
+	}
+	// Lock the slot by making the counter odd
+	uint64_t locked = LOCKED((seq | 1) + ((seq & 1) ? 2 : 0), getpid());
+	if (!__atomic_compare_exchange_n(&slot->lock, &lock, locked, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		lua_pushboolean(L, false);
+		return 1;
+	}
+	slot->written = now_ms();
+	// If invalidated since the check above, the readers reject it
+	slot->generation = generation;
+	slot->key_len = key_len;
+	memcpy(slot->key, key, key_len);
+	slot->data_len = data_len;
+	memcpy(slot->data, data, data_len);
+	// Unlock, making the counter even (and different from before)
+	__atomic_store_n(&slot->lock, LOCKED(SEQ(locked) + 1, 0), __ATOMIC_RELEASE);
+	lua_pushboolean(L, true);
+	return 1;
+}
+
+/*
+ * shm_cache_invalidate()
+ *
+ * Drop everything from the cache (of all the processes).
+ */
+static int shm_cache_invalidate_lua(lua_State *L) {
+	(void) L;
+	struct cache *cache = cache_get();
+	if (cache)
+		__atomic_add_fetch(&cache->generation, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void shm_cache_init(lua_State *L) {
+	lua_register(L, "shm_cache_get", shm_cache_get_lua);
+	lua_register(L, "shm_cache_put", shm_cache_put_lua);
+	lua_register(L, "shm_cache_generation", shm_cache_generation_lua);
+	lua_register(L, "shm_cache_invalidate", shm_cache_invalidate_lua);
+}
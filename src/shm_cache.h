@@ -0,0 +1,39 @@
+/*
+ * Copyright 2013, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of NUCI configuration server.
+ *
+ * NUCI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * NUCI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NUCI_SHM_CACHE_H
+#define NUCI_SHM_CACHE_H
+
+#include <lua.h>
+
+/*
+ * Cache of get() results shared between the nuci processes. It lives in a
+ * memory-mapped file (/var/run/nuci/cache, or $NUCI_SHM_CACHE) with a fixed
+ * number of slots. The slots are protected by sequence counters, so the
+ * readers never block and never see a half-written value. Writers just give
+ * up if someone else is writing the same slot.
+ *
+ * This registers the shm_cache_get, shm_cache_put, shm_cache_generation and
+ * shm_cache_invalidate lua functions. The file is mapped on the first use.
+ * If it can't be, or it isn't a private regular file of our user, the cache
+ * just never hits.
+ */
+void shm_cache_init(lua_State *L);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * Copyright 2013, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of NUCI configuration server.
+ *
+ * NUCI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * NUCI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sysinfo.h"
+
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/utsname.h>
+#include <sys/sysinfo.h>
+
+// The format of `date -Iseconds`
+#define ISO_FORMAT "%Y-%m-%dT%H:%M:%S%z"
+
+static int clock_gettime_lua(lua_State *lua) {
+	const char *name = luaL_optstring(lua, 1, "realtime");
+	clockid_t clock;
+	if (strcmp(name, "realtime") == 0)
+		clock = CLOCK_REALTIME;
+	else if (strcmp(name, "monotonic") == 0)
+		clock = CLOCK_MONOTONIC;
+	else
+		return luaL_error(lua, "Unknown clock %s", name);
+	struct timespec ts;
+	if (clock_gettime(clock, &ts) == -1)
+		return luaL_error(lua, "clock_gettime: %s", strerror(errno));
+	lua_pushnumber(lua, ts.tv_sec + ts.tv_nsec / 1000000000.0);
+	return 1;
+}
+
+static int date_lua(lua_State *lua) {
+	const char *format = luaL_optstring(lua, 1, ISO_FORMAT);
+	bool utc = lua_toboolean(lua, 2);
+	time_t now = time(NULL);
+	struct tm tm;
+	if (utc) {
+		gmtime_r(&now, &tm);
+	} else {
+		// The time zone may have been changed by a commit since the last time
+		tzset();
+		localtime_r(&now, &tm);
+	}
+	char buffer[256];
+	size_t len = strftime(buffer, sizeof buffer, format, &tm);
+	if (!len && *format)
+		return luaL_error(lua, "Formatted date too long");
+	lua_pushlstring(lua, buffer, len);
+	return 1;
+}
+
+static int uname_lua(lua_State *lua) {
+	struct utsname info;
+	if (uname(&info) == -1)
+		return luaL_error(lua, "uname: %s", strerror(errno));
+	lua_createtable(lua, 0, 5);
+	lua_pushstring(lua, info.sysname);
+	lua_setfield(lua, -2, "sysname");
+	lua_pushstring(lua, info.nodename);
+	lua_setfield(lua, -2, "nodename");
+	lua_pushstring(lua, info.release);
+	lua_setfield(lua, -2, "release");
+	lua_pushstring(lua, info.version);
+	lua_setfield(lua, -2, "version");
+	lua_pushstring(lua, info.machine);
+	lua_setfield(lua, -2, "machine");
+	return 1;
+}
+
+static void set_number(lua_State *lua, const char *name, lua_Number value) {
+	lua_pushnumber(lua, value);
+	lua_setfield(lua, -2, name);
+}
+
+static int sysinfo_lua(lua_State *lua) {
+	struct sysinfo info;
+	if (sysinfo(&info) == -1)
+		return luaL_error(lua, "sysinfo: %s", strerror(errno));
+	lua_createtable(lua, 0, 9);
+	set_number(lua, "uptime", info.uptime);
+	lua_createtable(lua, 3, 0);
+	for (size_t i = 0; i < 3; i ++) {
+		lua_pushnumber(lua, info.loads[i] / (lua_Number) (1 << SI_LOAD_SHIFT));
+		lua_rawseti(lua, -2, i + 1);
+	}
+	lua_setfield(lua, -2, "loads");
+	lua_Number unit = info.mem_unit ? info.mem_unit : 1;
+	set_number(lua, "totalram", info.totalram * unit);
+	set_number(lua, "freeram", info.freeram * unit);
+	set_number(lua, "sharedram", info.sharedram * unit);
+	set_number(lua, "bufferram", info.bufferram * unit);
+	set_number(lua, "totalswap", info.totalswap * unit);
+	set_number(lua, "freeswap", info.freeswap * unit);
+	set_number(lua, "procs", info.procs);
+	return 1;
+}
+
+// Strip the white space at both ends, in place
+static char *trim(char *str) {
+	while (isspace((unsigned char) *str))
+		str ++;
+	char *end = str + strlen(str);
+	while (end > str && isspace((unsigned char) end[-1]))
+		*-- end = '\0';
+	return str;
+}
+
+static int read_kv_lua(lua_State *lua) {
+	const char *path = luaL_checkstring(lua, 1);
+	const char *separator = luaL_optstring(lua, 2, "=");
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		lua_pushnil(lua);
+		lua_pushfstring(lua, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+	lua_newtable(lua);
+	char *line = NULL;
+	size_t allocated = 0;
+	while (getline(&line, &allocated, file) != -1) {
+		char *split = strstr(line, separator);
+		if (!split || *line == '#')
+			continue;
+		*split = '\0';
+		char *key = trim(line), *value = trim(split + strlen(separator));
+		size_t len = strlen(value);
+		if (len >= 2 && (*value == '"' || *value == '\'') && value[len - 1] == *value) {
+			value[len - 1] = '\0';
+			value ++;
+		}
+		lua_pushstring(lua, value);
+		lua_setfield(lua, -2, key);
+	}
+	free(line);
+	fclose(file);
+	return 1;
+}
+
+static const luaL_Reg sysinfo_funcs[] = {
+	{ "clock_gettime", clock_gettime_lua },
+	{ "date", date_lua },
+	{ "uname", uname_lua },
+	{ "sysinfo", sysinfo_lua },
+	{ "read_kv", read_kv_lua },
+	{ NULL, NULL }
+};
+
+void sysinfo_init(lua_State *L) {
+	luaL_register(L, "sysinfo", sysinfo_funcs);
+	lua_pop(L, 1);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2013, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of NUCI configuration server.
+ *
+ * NUCI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * NUCI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NUCI_SYSINFO_H
+#define NUCI_SYSINFO_H
+
+#include <lua.h>
+
+/*
+ * Information about the system, without running external commands for it.
+ * Registers the sysinfo lua library with these functions:
+ *
+ * - clock_gettime([clock]): The time in seconds (with fraction). The clock
+ *   is 'realtime' (the default) or 'monotonic'.
+ * - date([format[, utc]]): The current time formatted by strftime, in the
+ *   local time zone (or in UTC if utc is true). The default format is
+ *   the one of `date -Iseconds`.
+ * - uname(): Table with sysname, nodename, release, version and machine.
+ * - sysinfo(): Table with uptime, loads (table of 3 numbers), totalram,
+ *   freeram, sharedram, bufferram, totalswap, freeswap (in bytes) and
+ *   procs.
+ * - read_kv(path[, separator]): Read a file with KEY=value lines (like
+ *   /etc/openwrt_release) into a table. Quotes around the values are
+ *   removed. The separator may be different from '='. Returns nil and
+ *   error message if the file can't be read.
+ */
+void sysinfo_init(lua_State *L);
+
+#endif
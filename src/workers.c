@@ -0,0 +1,214 @@
+/*
+ * Copyright 2013, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of NUCI configuration server.
+ *
+ * NUCI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * NUCI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "workers.h"
+#include "interpreter.h"
+#include "logging.h"
+
+#include <libnetconf.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <libxml/tree.h>
+
+struct worker {
+	struct workers *pool;
+	size_t index;
+	struct interpreter *interpreter;
+	pthread_t thread;
+	unsigned generation; // The commit generation its uci cursor is from
+};
+
+struct workers {
+	size_t count;
+	struct worker *workers;
+	bool started, quit;
+	pthread_mutex_t mutex;
+	pthread_cond_t job_cond, done_cond;
+	unsigned job_id; // Changes with each job
+	size_t pending; // Number of workers still working on the current job
+	// The current job
+	size_t job_count;
+	const char *const *namespaces;
+	const xmlNode *const *filters;
+	xmlDoc **docs;
+	struct nc_err **errors;
+};
+
+struct workers *workers_create(size_t count, const char *plugin_path) {
+	struct workers *result = malloc(sizeof *result);
+	*result = (struct workers) {
+		.count = count,
+		.workers = calloc(count, sizeof *result->workers)
+	};
+	pthread_mutex_init(&result->mutex, NULL);
+	pthread_cond_init(&result->job_cond, NULL);
+	pthread_cond_init(&result->done_cond, NULL);
+	for (size_t i = 0; i < count; i ++) {
+		struct worker *worker = &result->workers[i];
+		worker->pool = result;
+		worker->index = i;
+		worker->interpreter = interpreter_create_worker();
+		worker->generation = interpreter_commit_generation();
+		if (!interpreter_load_plugins(worker->interpreter, plugin_path)) {
+			nlog(NLOG_ERROR, "Failed to load plugins into worker %zu", i);
+			workers_destroy(result);
+			return NULL;
+		}
+	}
+	nlog(NLOG_INFO, "Created %zu workers", count);
+	return result;
+}
+
+// Anything that changed in the configuration since the last job must be seen
+static void worker_refresh(struct worker *worker) {
+	unsigned generation = interpreter_commit_generation();
+	if (generation == worker->generation)
+		return;
+	worker->generation = generation;
+	lua_State *lua = interpreter_get_lua(worker->interpreter);
+	lua_getglobal(lua, "reset_uci_cursor");
+	if (lua_pcall(lua, 0, 0, 0) != 0) {
+		nlog(NLOG_WARN, "Failed to reset uci cursor of worker %zu: %s", worker->index, lua_tostring(lua, -1));
+		lua_pop(lua, 1);
+	}
+}
+
+// Do our part of the current job
+static void worker_job(struct worker *worker) {
+	struct workers *pool = worker->pool;
+	size_t count = (pool->job_count + pool->count - 1) / pool->count;
+	size_t indices[count];
+	lua_datastore datastores[count];
+	const xmlNode *filters[count];
+	xmlDoc *docs[count];
+	struct nc_err *errors[count];
+	size_t used = 0;
+	worker_refresh(worker);
+	for (size_t i = worker->index; i < pool->job_count; i += pool->count) {
+		lua_datastore datastore = interpreter_worker_datastore(worker->interpreter, pool->namespaces[i]);
+		if (datastore == LUA_NOREF) {
+			struct nc_err *error = nc_err_new(NC_ERR_OP_FAILED);
+			nc_err_set(error, NC_ERR_PARAM_TYPE, "application");
+			nc_err_set(error, NC_ERR_PARAM_SEVERITY, "error");
+			nc_err_set(error, NC_ERR_PARAM_MSG, "The data store is not loaded in the worker");
+			pool->docs[i] = NULL;
+			pool->errors[i] = error;
+			continue;
+		}
+		indices[used] = i;
+		datastores[used] = datastore;
+		filters[used] = pool->filters[i];
+		used ++;
+	}
+	interpreter_get_docs(worker->interpreter, used, datastores, "get_cached", filters, docs, errors);
+	for (size_t i = 0; i < used; i ++) {
+		pool->docs[indices[i]] = docs[i];
+		pool->errors[indices[i]] = errors[i];
+	}
+	interpreter_gc_check(worker->interpreter);
+}
+
+static void *worker_run(void *data) {
+	struct worker *worker = data;
+	struct workers *pool = worker->pool;
+	unsigned seen = 0; // The threads start before the first job
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->quit && pool->job_id == seen)
+			pthread_cond_wait(&pool->job_cond, &pool->mutex);
+		if (pool->quit)
+			break;
+		seen = pool->job_id;
+		pthread_mutex_unlock(&pool->mutex);
+		worker_job(worker);
+		pthread_mutex_lock(&pool->mutex);
+		if (!-- pool->pending)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+/*
+ * Start the threads. It is done on the first use, since the threads don't
+ * survive fork.
+ */
+static void workers_start(struct workers *workers) {
+	if (workers->started)
+		return;
+	// The signals are for the main thread, the workers shouldn't be interrupted by them
+	sigset_t all, orig;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &orig);
+	for (size_t i = 0; i < workers->count; i ++) {
+		int error = pthread_create(&workers->workers[i].thread, NULL, worker_run, &workers->workers[i]);
+		if (error)
+			die("Couldn't start worker thread: %s", strerror(error));
+	}
+	pthread_sigmask(SIG_SETMASK, &orig, NULL);
+	workers->started = true;
+}
+
+void workers_get_docs(struct workers *workers, size_t count, const char *const *namespaces, const xmlNode *const *filters, xmlDoc **docs, struct nc_err **errors) {
+	if (!count)
+		return;
+	workers_start(workers);
+	pthread_mutex_lock(&workers->mutex);
+	workers->job_count = count;
+	workers->namespaces = namespaces;
+	workers->filters = filters;
+	workers->docs = docs;
+	workers->errors = errors;
+	workers->pending = workers->count;
+	workers->job_id ++;
+	pthread_cond_broadcast(&workers->job_cond);
+	while (workers->pending)
+		pthread_cond_wait(&workers->done_cond, &workers->mutex);
+	pthread_mutex_unlock(&workers->mutex);
+}
+
+void workers_gc_freeze(struct workers *workers) {
+	for (size_t i = 0; i < workers->count; i ++)
+		interpreter_gc_freeze(workers->workers[i].interpreter);
+}
+
+void workers_destroy(struct workers *workers) {
+	if (workers->started) {
+		pthread_mutex_lock(&workers->mutex);
+		workers->quit = true;
+		pthread_cond_broadcast(&workers->job_cond);
+		pthread_mutex_unlock(&workers->mutex);
+		for (size_t i = 0; i < workers->count; i ++)
+			pthread_join(workers->workers[i].thread, NULL);
+	}
+	for (size_t i = 0; i < workers->count; i ++)
+		if (workers->workers[i].interpreter)
+			interpreter_destroy(workers->workers[i].interpreter);
+	pthread_cond_destroy(&workers->done_cond);
+	pthread_cond_destroy(&workers->job_cond);
+	pthread_mutex_destroy(&workers->mutex);
+	free(workers->workers);
+	free(workers);
+}
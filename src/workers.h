@@ -0,0 +1,57 @@
+/*
+ * Copyright 2013, CZ.NIC z.s.p.o. (http://www.nic.cz/)
+ *
+ * This file is part of NUCI configuration server.
+ *
+ * NUCI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ * NUCI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NUCI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NUCI_WORKERS_H
+#define NUCI_WORKERS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Worker threads, each with its own lua interpreter with all the plugins
+ * loaded. They compute the state of the data stores (the get method) in
+ * parallel, on multiple cores. Everything else (the configuration, commits,
+ * user RPCs) stays with the main interpreter.
+ *
+ * The threads are started on the first use, so the workers may be created
+ * before forking (and the interpreters shared with the children).
+ */
+struct workers;
+
+/*
+ * Create count workers and load the plugins from the path into each of
+ * them. Returns NULL on error (which is logged).
+ */
+struct workers *workers_create(size_t count, const char *plugin_path);
+void workers_destroy(struct workers *workers);
+
+// Like interpreter_gc_freeze, for all the worker interpreters.
+void workers_gc_freeze(struct workers *workers);
+
+struct _xmlNode;
+struct _xmlDoc;
+struct nc_err;
+/*
+ * Call the get_cached method of the data stores with given namespaces,
+ * like interpreter_get_docs. The data store number i is handled by the
+ * worker number i % (number of workers). Blocks until all are done.
+ */
+void workers_get_docs(struct workers *workers, size_t count, const char *const *namespaces, const struct _xmlNode *const *filters, struct _xmlDoc **docs, struct nc_err **errors);
+
+#endif
@@ -48,17 +48,28 @@
 
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include <libxml/xpath.h>
+#include <libxml/xpathInternals.h>
+#include <libxml/xmlwriter.h>
 #include <lauxlib.h>
 #include <lualib.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
 #define WRAP_XMLDOC		"xmlDocPtr"
 #define WRAP_XMLNODE		"xmlNodePtr"
+#define WRAP_XPATH		"xmlXPathCompExprPtr"
+#define WRAP_WRITER		"xmlTextWriterPtr"
+// Registry table with compiled xpath expressions, expression -> compiled one
+#define XPATH_CACHE		"nuci.xpath_cache"
+// Drop the whole cache when it grows over this many expressions
+#define XPATH_CACHE_MAX		256
 
 struct xmlwrap_object {
 	xmlDocPtr doc;
+	bool owned; // Free the doc when the object is garbage collected
 };
 
 #define luaL_newlibtable(L,l)	\
@@ -111,6 +122,7 @@ static int mod_read_file(lua_State *L) {
 	luaL_setmetatable(L, WRAP_XMLDOC);
 
 	xml2->doc = doc;
+	xml2->owned = true;
 	nlog(NLOG_TRACE, "Created XML DOC from file %p", (void *) doc);
 
 	return 1;
@@ -128,6 +140,7 @@ static int mod_read_memory(lua_State *L) {
 	luaL_setmetatable(L, WRAP_XMLDOC);
 
 	xml2->doc = doc;
+	xml2->owned = true;
 	nlog(NLOG_TRACE, "Created XML DOC from mem %p", (void *) doc);
 
 	return 1;
@@ -452,7 +465,8 @@ static int doc_get_root_element(lua_State *L) {
 	xmlNodePtr cur = NULL;
 	struct xmlwrap_object *xml2 = lua_touserdata(L, 1);
 
-	cur = xmlDocGetRootElement(xml2->doc);
+	if (xml2->doc)
+		cur = xmlDocGetRootElement(xml2->doc);
 	if (cur) {
 		lua_pushlightuserdata(L, cur);
 		luaL_setmetatable(L, WRAP_XMLNODE);
@@ -483,7 +497,7 @@ static int doc_gc(lua_State *L) {
 	struct xmlwrap_object *xml2 = lua_touserdata(L, 1);
 	nlog(NLOG_TRACE, "GC XML document %p", (void *) xml2->doc);
 
-	if (xml2->doc != NULL)
+	if (xml2->doc != NULL && xml2->owned)
 		xmlFreeDoc(xml2->doc);
 
 	return 0;
@@ -524,6 +538,7 @@ static int new_xml_doc(lua_State *L) {
 	luaL_setmetatable(L, WRAP_XMLDOC);
 
 	xml2->doc = doc;
+	xml2->owned = true;
 	xmlDocSetRootElement(xml2->doc, root_node);
 
 
@@ -561,6 +576,164 @@ static int node_add_child(lua_State *L) {
 	return 1;
 }
 
+/*
+ * Building of whole subtrees from lua tables in the form of
+ * { name = ..., namespace = ..., text = ..., children = { ... } }
+ * (the same as xmltree_dump takes).
+ */
+
+// Namespaces found above the subtree, remembered for the rest of the build
+#define TREE_NS_CACHE 8
+
+struct tree_build {
+	lua_State *L;
+	xmlDocPtr doc;
+	xmlNodePtr outer; // Where the subtree is attached, NULL when it is the root
+	size_t found_count;
+	xmlNsPtr found[TREE_NS_CACHE];
+};
+
+// Namespaces defined inside the subtree, valid for the descendants of the node defining them
+struct tree_scope {
+	xmlNsPtr ns;
+	const struct tree_scope *next;
+};
+
+/*
+ * Is the namespace usable for a child of parent? All the namespaces we
+ * declare are default ones, so a nested node may shadow an outer one.
+ */
+static bool tree_ns_visible(struct tree_build *build, xmlNodePtr parent, xmlNsPtr ns) {
+	return parent && xmlSearchNs(build->doc, parent, ns->prefix) == ns;
+}
+
+static xmlNsPtr tree_ns_lookup(struct tree_build *build, xmlNodePtr parent, const struct tree_scope *scope, const char *href, bool *in_scope) {
+	*in_scope = true;
+	// The most common case ‒ the same namespace as the parent
+	if (parent && parent->ns && xmlStrEqual(parent->ns->href, BAD_CAST href) && tree_ns_visible(build, parent, parent->ns))
+		return parent->ns;
+	for (; scope; scope = scope->next)
+		if (xmlStrEqual(scope->ns->href, BAD_CAST href))
+			return tree_ns_visible(build, parent, scope->ns) ? scope->ns : NULL;
+	for (size_t i = 0; i < build->found_count; i ++)
+		if (xmlStrEqual(build->found[i]->href, BAD_CAST href))
+			return tree_ns_visible(build, parent, build->found[i]) ? build->found[i] : NULL;
+	*in_scope = false;
+	if (!build->outer)
+		return NULL;
+	xmlNsPtr ns = xmlSearchNsByHref(build->doc, build->outer, BAD_CAST href);
+	if (ns && build->found_count < TREE_NS_CACHE) {
+		build->found[build->found_count ++] = ns;
+		*in_scope = true;
+	}
+	return ns && tree_ns_visible(build, parent, ns) ? ns : NULL;
+}
+
+/*
+ * Create the node described by the table on the top of the stack as a
+ * child of parent (or as the root element if parent is NULL).
+ */
+static xmlNodePtr tree_node(struct tree_build *build, xmlNodePtr parent, const struct tree_scope *scope) {
+	lua_State *L = build->L;
+	luaL_checkstack(L, 3, "add_tree: Tree too deep");
+	lua_getfield(L, -1, "name");
+	const char *name = lua_tostring(L, -1);
+	if (name == NULL) luaL_error(L, "add_tree: Node without name");
+	lua_getfield(L, -2, "namespace");
+	const char *ns_href = lua_tostring(L, -1);
+
+	bool in_scope = false;
+	xmlNsPtr ns = ns_href ? tree_ns_lookup(build, parent, scope, ns_href, &in_scope) : NULL;
+	xmlNodePtr node;
+	if (parent) {
+		// Like add_child, without namespace it inherits the one of parent
+		node = xmlNewChild(parent, ns, BAD_CAST name, NULL);
+	} else {
+		node = xmlNewDocNode(build->doc, NULL, BAD_CAST name, NULL);
+		xmlDocSetRootElement(build->doc, node);
+	}
+	struct tree_scope defined = { .next = scope };
+	if (ns_href && !ns) {
+		ns = xmlNewNs(node, BAD_CAST ns_href, NULL);
+		if (ns == NULL) luaL_error(L, "Namespace allocation error.");
+		xmlSetNs(node, ns);
+		in_scope = false;
+	}
+	if (ns && !in_scope) {
+		defined.ns = ns;
+		scope = &defined;
+	}
+	lua_pop(L, 2);
+
+	lua_getfield(L, -1, "children");
+	if (lua_istable(L, -1)) {
+		for (int i = 1; ; i ++) {
+			lua_rawgeti(L, -1, i);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				break;
+			}
+			if (!lua_istable(L, -1)) luaL_error(L, "add_tree: Child %d of %s is not a table", i, name);
+			tree_node(build, node, scope);
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "text");
+	const char *text = lua_tostring(L, -1);
+	if (text)
+		xmlAddChild(node, xmlNewText(BAD_CAST text));
+	lua_pop(L, 1);
+
+	return node;
+}
+
+static int node_add_tree(lua_State *L) {
+	xmlNodePtr node = lua_touserdata(L, 1);
+
+	if (node == NULL) return luaL_error(L, "add_tree: Invalid parent node");
+	if (node->type != XML_ELEMENT_NODE) return luaL_error(L, "add_tree: Invalid parent node type (not element node)");
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+
+	struct tree_build build = {
+		.L = L,
+		.doc = node->doc,
+		.outer = node
+	};
+	xmlNodePtr child = tree_node(&build, node, NULL);
+
+	lua_pushlightuserdata(L, child);
+	luaL_setmetatable(L, WRAP_XMLNODE);
+
+	return 1;
+}
+
+static int mod_from_table(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+
+	xmlDocPtr doc = xmlNewDoc(BAD_CAST "1.0");
+	if (doc == NULL) return luaL_error(L, "New document allocation error.");
+
+	// Wrap it first, so it is freed if the build fails
+	struct xmlwrap_object *xml2 = lua_newuserdata(L, sizeof(*xml2));
+	luaL_setmetatable(L, WRAP_XMLDOC);
+	xml2->doc = doc;
+	xml2->owned = true;
+
+	struct tree_build build = {
+		.L = L,
+		.doc = doc
+	};
+	lua_pushvalue(L, 1);
+	tree_node(&build, NULL, NULL);
+	lua_pop(L, 1);
+
+	return 1;
+}
+
 /**
  * This function recursively delete this node and it's childs.
  * void return code is OK, because both function has void too
@@ -652,7 +825,7 @@ static int node_register_ns(lua_State *L) {
 static int doc_strdump(lua_State *L) {
 	struct xmlwrap_object *xml2 = lua_touserdata(L, 1);
 
-	if (xml2 == NULL) return luaL_error(L, "Invalid xml document");
+	if (xml2 == NULL || xml2->doc == NULL) return luaL_error(L, "Invalid xml document");
 
 	xmlChar *str;
 	int size;
@@ -670,6 +843,310 @@ static int doc_strdump(lua_State *L) {
 	return 1;
 }
 
+static int xpath_gc(lua_State *L) {
+	xmlXPathCompExprPtr *comp = luaL_checkudata(L, 1, WRAP_XPATH);
+	if (*comp)
+		xmlXPathFreeCompExpr(*comp);
+	*comp = NULL;
+	return 0;
+}
+
+/*
+ * Get the compiled expression from the cache, or compile it and put it
+ * there. The cache is per lua state, so the worker threads don't share it.
+ */
+static xmlXPathCompExprPtr xpath_compile(lua_State *L, const char *expr) {
+	lua_getfield(L, LUA_REGISTRYINDEX, XPATH_CACHE);
+	lua_getfield(L, -1, expr);
+	if (!lua_isnil(L, -1)) {
+		xmlXPathCompExprPtr comp = *(xmlXPathCompExprPtr *) lua_touserdata(L, -1);
+		lua_pop(L, 2);
+		return comp;
+	}
+	lua_pop(L, 1);
+	// The count of the cached expressions is at index 1, it can't clash with the (string) expressions
+	lua_rawgeti(L, -1, 1);
+	int count = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (count >= XPATH_CACHE_MAX) {
+		// Simply start over, the old ones get collected
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, XPATH_CACHE);
+		count = 0;
+	}
+	xmlXPathCompExprPtr comp = xmlXPathCompile(BAD_CAST expr);
+	if (!comp) {
+		luaL_error(L, "xpath: Invalid expression %s", expr);
+		return NULL;
+	}
+	xmlXPathCompExprPtr *wrapped = lua_newuserdata(L, sizeof *wrapped);
+	*wrapped = comp;
+	luaL_setmetatable(L, WRAP_XPATH);
+	lua_setfield(L, -2, expr);
+	lua_pushinteger(L, count + 1);
+	lua_rawseti(L, -2, 1);
+	lua_pop(L, 1);
+	return comp;
+}
+
+// Push the result of xpath evaluation to lua
+static void xpath_push_result(lua_State *L, xmlXPathObjectPtr result) {
+	switch (result->type) {
+		case XPATH_NODESET: {
+			xmlNodeSetPtr nodes = result->nodesetval;
+			int count = nodes ? nodes->nodeNr : 0;
+			lua_createtable(L, count, 0);
+			for (int i = 0; i < count; i ++) {
+				xmlNodePtr node = nodes->nodeTab[i];
+				if (node->type == XML_ATTRIBUTE_NODE || node->type == XML_NAMESPACE_DECL) {
+					// These are not really nodes, return their values
+					xmlChar *value = xmlXPathCastNodeToString(node);
+					lua_pushstring(L, (const char *) value);
+					xmlFree(value);
+				} else {
+					lua_pushlightuserdata(L, node);
+					luaL_setmetatable(L, WRAP_XMLNODE);
+				}
+				lua_rawseti(L, -2, i + 1);
+			}
+			break;
+		}
+		case XPATH_BOOLEAN:
+			lua_pushboolean(L, result->boolval);
+			break;
+		case XPATH_NUMBER:
+			lua_pushnumber(L, result->floatval);
+			break;
+		case XPATH_STRING:
+			lua_pushstring(L, (const char *) result->stringval);
+			break;
+		default:
+			lua_pushnil(L);
+			break;
+	}
+}
+
+/*
+ * Evaluate the xpath expression with the node as the context. The
+ * namespace prefixes in scope of the ns_node are available, more may be
+ * passed in the nsmap table (prefix -> uri).
+ */
+static int xpath_eval(lua_State *L, xmlDocPtr doc, xmlNodePtr node, xmlNodePtr ns_node) {
+	const char *expr = luaL_checkstring(L, 2);
+	xmlXPathCompExprPtr comp = xpath_compile(L, expr);
+	xmlXPathContextPtr context = xmlXPathNewContext(doc);
+	context->node = node;
+	xmlNsPtr *ns_list = ns_node ? xmlGetNsList(doc, ns_node) : NULL;
+	if (ns_list) {
+		for (xmlNsPtr *ns = ns_list; *ns; ns ++)
+			if ((*ns)->prefix)
+				xmlXPathRegisterNs(context, (*ns)->prefix, (*ns)->href);
+		xmlFree(ns_list);
+	}
+	if (lua_istable(L, 3)) {
+		lua_pushnil(L);
+		while (lua_next(L, 3)) {
+			if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1))
+				xmlXPathRegisterNs(context, BAD_CAST lua_tostring(L, -2), BAD_CAST lua_tostring(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	xmlXPathObjectPtr result = xmlXPathCompiledEval(comp, context);
+	xmlXPathFreeContext(context);
+	if (!result)
+		return luaL_error(L, "xpath: Failed to evaluate %s", expr);
+	xpath_push_result(L, result);
+	xmlXPathFreeObject(result);
+	return 1;
+}
+
+static int node_xpath(lua_State *L) {
+	xmlNodePtr node = lua_touserdata(L, 1);
+
+	if (node == NULL) return luaL_error(L, "xpath: Invalid node");
+
+	return xpath_eval(L, node->doc, node, node);
+}
+
+static int doc_xpath(lua_State *L) {
+	struct xmlwrap_object *xml2 = luaL_checkudata(L, 1, WRAP_XMLDOC);
+
+	if (xml2->doc == NULL) return luaL_error(L, "xpath: Invalid xml document");
+
+	// The prefixes declared at the root element are available
+	return xpath_eval(L, xml2->doc, (xmlNodePtr) xml2->doc, xmlDocGetRootElement(xml2->doc));
+}
+
+/*
+ * Streaming writer, producing the XML text directly, without building the
+ * DOM first.
+ */
+struct xmlwrap_writer {
+	xmlTextWriterPtr writer; // NULL once finished
+	xmlBufferPtr buffer;
+	size_t depth, allocated;
+	// The default namespace of each open element. Owned only where it changes.
+	struct writer_ns {
+		xmlChar *href;
+		bool owned;
+	} *namespaces;
+};
+
+static struct xmlwrap_writer *writer_check(lua_State *L) {
+	struct xmlwrap_writer *writer = luaL_checkudata(L, 1, WRAP_WRITER);
+	if (writer->writer == NULL) luaL_error(L, "The writer is already finished");
+	return writer;
+}
+
+static void writer_free(struct xmlwrap_writer *writer) {
+	if (writer->writer)
+		xmlFreeTextWriter(writer->writer);
+	writer->writer = NULL;
+	if (writer->buffer)
+		xmlBufferFree(writer->buffer);
+	writer->buffer = NULL;
+	for (size_t i = 0; i < writer->depth; i ++)
+		if (writer->namespaces[i].owned)
+			xmlFree(writer->namespaces[i].href);
+	free(writer->namespaces);
+	writer->namespaces = NULL;
+	writer->depth = writer->allocated = 0;
+}
+
+static int writer_gc(lua_State *L) {
+	writer_free(luaL_checkudata(L, 1, WRAP_WRITER));
+	return 0;
+}
+
+static int mod_writer(lua_State *L) {
+	struct xmlwrap_writer *writer = lua_newuserdata(L, sizeof *writer);
+	*writer = (struct xmlwrap_writer) { .writer = NULL };
+	luaL_setmetatable(L, WRAP_WRITER);
+	writer->buffer = xmlBufferCreate();
+	if (writer->buffer == NULL) return luaL_error(L, "Writer buffer allocation error.");
+	// The output may be large, don't reallocate for every piece of it
+	xmlBufferSetAllocationScheme(writer->buffer, XML_BUFFER_ALLOC_DOUBLEIT);
+	writer->writer = xmlNewTextWriterMemory(writer->buffer, 0);
+	if (writer->writer == NULL) return luaL_error(L, "Writer allocation error.");
+	return 1;
+}
+
+static int writer_start(lua_State *L) {
+	struct xmlwrap_writer *writer = writer_check(L);
+	const char *name = luaL_checkstring(L, 2);
+	const char *ns_href = lua_tostring(L, 3);
+
+	if (writer->depth == writer->allocated) {
+		writer->allocated = writer->allocated ? 2 * writer->allocated : 16;
+		writer->namespaces = realloc(writer->namespaces, writer->allocated * sizeof *writer->namespaces);
+	}
+	const xmlChar *current = writer->depth ? writer->namespaces[writer->depth - 1].href : NULL;
+
+	if (xmlTextWriterStartElement(writer->writer, BAD_CAST name) < 0) return luaL_error(L, "Failed to start element %s", name);
+	struct writer_ns *ns = &writer->namespaces[writer->depth ++];
+	*ns = (struct writer_ns) { .href = (xmlChar *) current };
+	if (ns_href && !xmlStrEqual(current, BAD_CAST ns_href)) {
+		// Declare it only when it differs from the one of the parent
+		ns->href = xmlStrdup(BAD_CAST ns_href);
+		ns->owned = true;
+		if (xmlTextWriterWriteAttribute(writer->writer, BAD_CAST "xmlns", BAD_CAST ns_href) < 0) return luaL_error(L, "Failed to write namespace of %s", name);
+	}
+
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int writer_attr(lua_State *L) {
+	struct xmlwrap_writer *writer = writer_check(L);
+	const char *name = luaL_checkstring(L, 2);
+	const char *value = luaL_checkstring(L, 3);
+
+	if (xmlTextWriterWriteAttribute(writer->writer, BAD_CAST name, BAD_CAST value) < 0) return luaL_error(L, "Failed to write attribute %s", name);
+
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int writer_text(lua_State *L) {
+	struct xmlwrap_writer *writer = writer_check(L);
+	const char *text = luaL_checkstring(L, 2);
+
+	if (xmlTextWriterWriteString(writer->writer, BAD_CAST text) < 0) return luaL_error(L, "Failed to write text");
+
+	lua_settop(L, 1);
+	return 1;
+}
+
+static void writer_close_element(lua_State *L, struct xmlwrap_writer *writer) {
+	if (writer->depth == 0) luaL_error(L, "No element to close");
+	struct writer_ns *ns = &writer->namespaces[-- writer->depth];
+	if (ns->owned)
+		xmlFree(ns->href);
+	if (xmlTextWriterEndElement(writer->writer) < 0) luaL_error(L, "Failed to close element");
+}
+
+static int writer_close(lua_State *L) {
+	writer_close_element(L, writer_check(L));
+
+	lua_settop(L, 1);
+	return 1;
+}
+
+// Write already formatted XML as it is
+static int writer_raw(lua_State *L) {
+	struct xmlwrap_writer *writer = writer_check(L);
+	size_t len;
+	const char *xml = luaL_checklstring(L, 2, &len);
+
+	if (len && xmlTextWriterWriteRawLen(writer->writer, BAD_CAST xml, len) < 0) return luaL_error(L, "Failed to write raw XML");
+
+	lua_settop(L, 1);
+	return 1;
+}
+
+// Shortcut for start(name), text(text), close()
+static int writer_element(lua_State *L) {
+	struct xmlwrap_writer *writer = writer_check(L);
+	const char *name = luaL_checkstring(L, 2);
+	const char *text = lua_tostring(L, 3);
+
+	if (xmlTextWriterStartElement(writer->writer, BAD_CAST name) < 0 ||
+			(text && xmlTextWriterWriteString(writer->writer, BAD_CAST text) < 0) ||
+			xmlTextWriterEndElement(writer->writer) < 0)
+		return luaL_error(L, "Failed to write element %s", name);
+
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int writer_finish(lua_State *L) {
+	struct xmlwrap_writer *writer = writer_check(L);
+
+	while (writer->depth)
+		writer_close_element(L, writer);
+	if (xmlTextWriterFlush(writer->writer) < 0) return luaL_error(L, "Failed to flush the writer");
+	xmlFreeTextWriter(writer->writer);
+	writer->writer = NULL;
+	lua_pushlstring(L, (const char *) xmlBufferContent(writer->buffer), xmlBufferLength(writer->buffer));
+	writer_free(writer);
+
+	return 1;
+}
+
+static const luaL_Reg xmlwrap_writer[] = {
+	{ "start", writer_start },
+	{ "attr", writer_attr },
+	{ "text", writer_text },
+	{ "close", writer_close },
+	{ "element", writer_element },
+	{ "raw", writer_raw },
+	{ "finish", writer_finish },
+	{ "__gc", writer_gc },
+	{ NULL, NULL }
+};
+
 static const luaL_Reg xmlwrap_node[] = {
 	{ "first_child", node_children_node },
 	{ "name", node_name },
@@ -683,8 +1160,10 @@ static const luaL_Reg xmlwrap_node[] = {
 	{ "set_text", node_set_text },
 	{ "parent", node_parent },
 	{ "add_child", node_add_child },
+	{ "add_tree", node_add_tree },
 	{ "register_ns", node_register_ns },
 	{ "delete", node_delete_node },
+	{ "xpath", node_xpath },
 	{ "__tostring", node_tostring },
 	{ NULL, NULL }
 };
@@ -693,6 +1172,7 @@ static const luaL_Reg xmlwrap_doc[] = {
 	{ "root", doc_get_root_element },
 	{ "NodeListGetString", doc_node_list_get_string },
 	{ "strdump", doc_strdump },
+	{ "xpath", doc_xpath },
 	{ "__gc", doc_gc },
 	{ "__tostring", doc_tostring },
 	{ NULL, NULL }
@@ -706,6 +1186,48 @@ static void add_func(lua_State *L, const char *name, lua_CFunction function) {
 	lua_setfield(L, -2, name);
 }
 
+void xmlwrap_push_doc(lua_State *L, struct _xmlDoc *doc, bool owned) {
+	struct xmlwrap_object *xml2 = lua_newuserdata(L, sizeof(*xml2));
+	luaL_setmetatable(L, WRAP_XMLDOC);
+
+	xml2->doc = doc;
+	xml2->owned = owned;
+}
+
+void xmlwrap_push_node(lua_State *L, struct _xmlNode *node) {
+	lua_pushlightuserdata(L, node);
+	luaL_setmetatable(L, WRAP_XMLNODE);
+}
+
+static struct xmlwrap_object *to_doc_object(lua_State *L, int index) {
+	struct xmlwrap_object *xml2 = lua_touserdata(L, index);
+	if (!xml2 || lua_islightuserdata(L, index) || !lua_getmetatable(L, index))
+		return NULL;
+	luaL_getmetatable(L, WRAP_XMLDOC);
+	bool is_doc = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return is_doc ? xml2 : NULL;
+}
+
+struct _xmlDoc *xmlwrap_get_doc(lua_State *L, int index) {
+	struct xmlwrap_object *xml2 = to_doc_object(L, index);
+	return xml2 ? xml2->doc : NULL;
+}
+
+struct _xmlDoc *xmlwrap_take_doc(lua_State *L, int index) {
+	struct xmlwrap_object *xml2 = to_doc_object(L, index);
+	if (!xml2 || !xml2->doc)
+		return NULL;
+	if (!xml2->owned) // Someone else owns it, we can't take it away
+		return xmlCopyDoc(xml2->doc, 1);
+	xmlDocPtr doc = xml2->doc;
+	// The object stays there, but empty
+	xml2->doc = NULL;
+	xml2->owned = false;
+	nlog(NLOG_TRACE, "Taken XML DOC %p from lua", (void *) doc);
+	return doc;
+}
+
 /*
  * Lua libxml2 binding registration
  */
@@ -716,6 +1238,8 @@ int xmlwrap_init(lua_State *L) {
 	add_func(L, "read_file", mod_read_file);
 	add_func(L, "read_memory", mod_read_memory);
 	add_func(L, "new_xml_doc", new_xml_doc);
+	add_func(L, "from_table", mod_from_table);
+	add_func(L, "writer", mod_writer);
 
 	// Push the package as xmlwrap (which pops it)
 	lua_setglobal(L, "xmlwrap");
@@ -740,5 +1264,22 @@ int xmlwrap_init(lua_State *L) {
 	luaL_setfuncs(L, xmlwrap_node, 0);  /* add xmlNode methods to the new metatable */
 	lua_pop(L, 1);
 
+	/* Register metatable for the writers */
+
+	luaL_newmetatable(L, WRAP_WRITER);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, xmlwrap_writer, 0);
+	lua_pop(L, 1);
+
+	/* The compiled xpath expressions and their cache */
+
+	luaL_newmetatable(L, WRAP_XPATH);
+	lua_pushcfunction(L, xpath_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, XPATH_CACHE);
+
 	return 1;
 }
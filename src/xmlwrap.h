@@ -2,7 +2,35 @@
 #define LUA_XMLWRAP_H
 
 #include <lua.h>
+#include <stdbool.h>
+
+struct _xmlDoc;
+struct _xmlNode;
 
 int xmlwrap_init(lua_State *L);
 
+/*
+ * Push the document to the lua stack, wrapped as xmlwrap document object.
+ * If owned is true, the document is freed with the object. Otherwise, the
+ * caller keeps the ownership and must keep the document alive as long as
+ * lua may use it.
+ */
+void xmlwrap_push_doc(lua_State *L, struct _xmlDoc *doc, bool owned);
+
+/*
+ * Push the node to the lua stack, as xmlwrap node. The node must stay alive
+ * as long as lua may use it.
+ */
+void xmlwrap_push_node(lua_State *L, struct _xmlNode *node);
+
+// Get the document from the xmlwrap object at the index. NULL if it is not a document.
+struct _xmlDoc *xmlwrap_get_doc(lua_State *L, int index);
+/*
+ * Take the document from the xmlwrap object at the index, passing the
+ * ownership to the caller. The lua object is left empty. If the object
+ * doesn't own the document, a copy is returned. NULL if it is not a
+ * document.
+ */
+struct _xmlDoc *xmlwrap_take_doc(lua_State *L, int index);
+
 #endif /* LUA_XMLWRAP_H */
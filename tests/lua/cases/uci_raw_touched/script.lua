@@ -0,0 +1,39 @@
+-- Catch the data store instead of registering it
+local store;
+function register_datastore_provider(datastore)
+	store = datastore;
+end
+dofile("src/lua_plugins/uci-raw.lua");
+store.model_ns = 'http://www.nic.cz/ns/router/uci-raw';
+
+-- Don't touch the real uci, just show what gets dumped
+function uci_list_configs()
+	return { 'system', 'network', 'firewall' };
+end
+function commit_is_dirty(config)
+	return false;
+end
+function get_uci_cursor() end
+function reset_uci_cursor() end
+function uci_raw_dump(configs)
+	io.stdout:write("Dump: " .. table.concat(configs, " ") .. "\n");
+	return '', {};
+end
+
+local function edit(command, defop)
+	store:edit_config_current(xmlwrap.read_memory('<edit>' .. command .. '</edit>'), defop);
+end
+
+edit([[
+  <uci xmlns="http://www.nic.cz/ns/router/uci-raw">
+    <config>
+      <name>network</name>
+      <section>
+        <name>lan</name>
+      </section>
+    </config>
+  </uci>
+]], 'merge');
+edit('<uci xmlns="http://www.nic.cz/ns/router/uci-raw"><config><name>network</name></config><config><name>system</name></config></uci>', 'merge');
+edit('<uci xmlns="http://www.nic.cz/ns/router/uci-raw"><config><name>network</name></config></uci>', 'replace');
+edit('<uci xmlns="http://www.nic.cz/ns/router/uci-raw"><config><name>missing</name></config></uci>', 'merge');
@@ -0,0 +1,9 @@
+local writer = xmlwrap.writer();
+writer:start("root", "http://example.org/a"):attr("id", "1 & 2");
+writer:element("item", "a < b"):element("empty");
+writer:start("sub", "http://example.org/a"):text(42):close();
+writer:start("other", "http://example.org/b"):element("leaf", "x");
+-- The open elements are closed by finish
+io.stdout:write("O1: " .. writer:finish() .. "\n");
+
+io.stdout:write("O2: " .. tostring(pcall(writer.text, writer, "more")) .. "\n");
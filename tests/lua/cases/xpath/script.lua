@@ -0,0 +1,29 @@
+local doc = xmlwrap.read_memory('<root xmlns="http://example.org/a" xmlns:b="http://example.org/b"><item name="x">1</item><item name="y">2</item><b:other>3</b:other><plain xmlns="">4</plain></root>');
+local root = doc:root();
+local ns = { a = "http://example.org/a" };
+
+local items = root:xpath("a:item", ns);
+io.stdout:write("O1: " .. #items .. " " .. items[1]:text() .. " " .. items[2]:text() .. "\n");
+
+-- The prefixes declared in the document are available without nsmap
+io.stdout:write("O2: " .. root:xpath("b:other")[1]:text() .. "\n");
+
+io.stdout:write("O3: " .. root:xpath("plain")[1]:text() .. "\n");
+
+io.stdout:write("O4: " .. doc:xpath("count(//a:item)", ns) .. "\n");
+
+io.stdout:write("O5: " .. doc:xpath("string(/a:root/a:item[2]/@name)", ns) .. "\n");
+
+local names = root:xpath("a:item/@name", ns);
+io.stdout:write("O6: " .. names[1] .. " " .. names[2] .. "\n");
+
+io.stdout:write("O7: " .. tostring(doc:xpath("boolean(//b:other)")) .. "\n");
+
+io.stdout:write("O8: " .. #root:xpath("a:missing", ns) .. "\n");
+
+io.stdout:write("O9: " .. tostring(pcall(root.xpath, root, "///")) .. "\n");
+
+io.stdout:write("O10: " .. root:xpath("a:item[@name='y']", ns)[1]:text() .. "\n");
+
+local union = root:xpath("b:other | a:item[@name='x']", ns);
+io.stdout:write("O11: " .. #union .. " " .. union[1]:text() .. " " .. union[2]:text() .. "\n");
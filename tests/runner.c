@@ -1,6 +1,7 @@
 #include "../src/xmlwrap.h"
 #include "../src/interpreter.h"
 #include "../src/logging.h"
+#include "../src/model.h"
 
 #include <lua.h>
 #include <lualib.h>
@@ -32,6 +33,7 @@ int main(int argc, const char *argv[]) {
 	}
 
 	interpreter_destroy(interpreter);
+	model_registry_free();
 
 	//libxml2 cleanup
 	xmlCleanupParser();
@@ -0,0 +1,43 @@
+#!bin/test_runner
+
+--[[
+Micro-benchmark of starting external commands. It runs a trivial command
+many times, one by one by run_command and in batches by run_commands, and
+prints the average time per command. Set SPAWN_BENCH_COUNT to change the
+number of runs (1000 by default).
+]]
+
+local count = tonumber(os.getenv("SPAWN_BENCH_COUNT") or 1000);
+local batch_size = 10;
+
+local function now()
+	return sysinfo.clock_gettime('monotonic');
+end
+
+local function report(name, start)
+	local total = now() - start;
+	print(string.format("%s: %d commands in %.3f s, %.3f ms per command", name, count, total, total * 1000 / count));
+end
+
+local start = now();
+for i = 1, count do
+	local ecode = run_command(nil, 'true');
+	if ecode ~= 0 then
+		error("Command failed with " .. ecode);
+	end
+end
+report("run_command", start);
+
+start = now();
+local batch = {};
+for i = 1, batch_size do
+	table.insert(batch, { 'true' });
+end
+for i = 1, count / batch_size do
+	for _, result in ipairs(run_commands(batch)) do
+		if result.code ~= 0 then
+			error("Command failed with " .. result.code);
+		end
+	end
+end
+report("run_commands (by " .. batch_size .. ")", start);
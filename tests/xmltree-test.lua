@@ -33,6 +33,10 @@ local cases = {
 	twins = {
 		input = { name = 'doc', namespace = 'http://example.org/namespace', children = { { name = 'child' }, { name = 'child' } } },
 		output = [[<doc xmlns="http://example.org/namespace"><child/><child/></doc>]]
+	},
+	nsreuse = {
+		input = { name = 'doc', namespace = 'http://example.org/namespace', children = { { name = 'child', namespace = 'http://example.org/another', children = { { name = 'sub', namespace = 'http://example.org/another', text = 'text' }, { name = 'sub', namespace = 'http://example.org/namespace' } } } } },
+		output = [[<doc xmlns="http://example.org/namespace"><child xmlns="http://example.org/another"><sub>text</sub><sub xmlns="http://example.org/namespace"/></child></doc>]]
 	}
 }
 